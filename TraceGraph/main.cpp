@@ -26,6 +26,7 @@
 int main(int argc, char *argv[])
 {
     qRegisterMetaType<Event>("Event");
+    qRegisterMetaType<QVector<Event> >("QVector<Event>");
     QApplication a(argc, argv);
     MainWindow w;
     if(argc > 1) {
@@ -22,10 +22,47 @@
 /* ===================================================================== */
 #include "sqliteclient.h"
 
+// Since SCHEMA_VERSION 3 addresses are INTEGER and opcodes or memory data are
+// BLOB, older databases store them as hex TEXT.
+static unsigned long long columnAddress(sqlite3_stmt *query, int i)
+{
+    if(sqlite3_column_type(query, i) == SQLITE_INTEGER)
+        return (unsigned long long) sqlite3_column_int64(query, i);
+    return strtoull((const char*) sqlite3_column_text(query, i), NULL, 16);
+}
+
+static unsigned int columnBytesSize(sqlite3_stmt *query, int i)
+{
+    if(sqlite3_column_type(query, i) == SQLITE_BLOB)
+        return sqlite3_column_bytes(query, i);
+    return strlen((const char*) sqlite3_column_text(query, i))/2;
+}
+
+static QString columnDescription(sqlite3_stmt *query, int i)
+{
+    const char *name = sqlite3_column_name(query, i);
+    switch(sqlite3_column_type(query, i))
+    {
+        case SQLITE_NULL:
+            return QString();
+        case SQLITE_BLOB:
+            return QString(QByteArray((const char*) sqlite3_column_blob(query, i), sqlite3_column_bytes(query, i)).toHex());
+        case SQLITE_INTEGER:
+            if(strcmp(name, "ip") == 0 || strcmp(name, "addr") == 0 || strcmp(name, "addr_end") == 0)
+                return QString("0x%1").arg((unsigned long long) sqlite3_column_int64(query, i), 16, 16, QLatin1Char('0'));
+            if(strcmp(name, "value") == 0)
+                return QString("0x%1").arg((unsigned long long) sqlite3_column_int64(query, i), 0, 16);
+            return QString::number(sqlite3_column_int64(query, i));
+        default:
+            return QString((const char*) sqlite3_column_text(query, i));
+    }
+}
+
 SqliteClient::SqliteClient(QObject *parent) :
     QObject(parent)
 {
     db = NULL;
+    schema_version = 1;
 }
 
 SqliteClient::~SqliteClient()
@@ -43,16 +80,18 @@ void SqliteClient::connectToDatabase(QString filename)
 
         sqlite3_bind_text(key_query, 1, "TRACERGRIND_VERSION", -1, SQLITE_TRANSIENT);
         if(sqlite3_step(key_query) == SQLITE_ROW) {
-            emit connectedToDatabase();
             sqlite3_finalize(key_query);
+            querySchemaVersion();
+            emit connectedToDatabase();
             return;
         }
         sqlite3_reset(key_query);
 
         sqlite3_bind_text(key_query, 1, "TRACERPIN_VERSION", -1, SQLITE_TRANSIENT);
         if(sqlite3_step(key_query) == SQLITE_ROW) {
-            emit connectedToDatabase();
             sqlite3_finalize(key_query);
+            querySchemaVersion();
+            emit connectedToDatabase();
             return;
         }
         sqlite3_finalize(key_query);
@@ -66,6 +105,21 @@ void SqliteClient::connectToDatabase(QString filename)
     }
 }
 
+void SqliteClient::querySchemaVersion()
+{
+    sqlite3_stmt *key_query;
+
+    schema_version = 1;
+    sqlite3_prepare_v2(db, "SELECT value FROM info where key='SCHEMA_VERSION';", -1, &key_query, NULL);
+    if(sqlite3_step(key_query) == SQLITE_ROW)
+    {
+        const char *value = (const char*) sqlite3_column_text(key_query, 0);
+        if(value != NULL)
+            schema_version = atoi(value);
+    }
+    sqlite3_finalize(key_query);
+}
+
 void SqliteClient::queryMetadata()
 {
     char** metadata = new char*[4];
@@ -167,29 +221,22 @@ void SqliteClient::queryStats()
     emit statResults(stats);
 }
 
-void SqliteClient::queryEvents()
+// Append the instructions of ins_query with the memory events of mem_query,
+// both ordered by instruction
+void SqliteClient::readEvents(sqlite3_stmt *ins_query, sqlite3_stmt *mem_query, QVector<Event> &events, unsigned long long &time)
 {
-    unsigned long long time = 0;
-    sqlite3_stmt *ins_query, *mem_query;
-
-
-    sqlite3_prepare_v2(db, "SELECT rowid, ip, op FROM ins;", -1, &ins_query, NULL);
-    sqlite3_prepare_v2(db, "SELECT rowid, ins_id, type, addr, size FROM mem;", -1, &mem_query, NULL);
     sqlite3_step(mem_query);
-
     while(sqlite3_step(ins_query) == SQLITE_ROW)
     {
         Event ins_ev;
         ins_ev.type = EVENT_INS;
         ins_ev.id[0] = sqlite3_column_int64(ins_query, 0);
         ins_ev.nbID = 1;
-        ins_ev.address = strtoul((const char*) sqlite3_column_text(ins_query, 1), NULL, 16);
-        ins_ev.size = strlen((const char*) sqlite3_column_text(ins_query, 2))/2;
+        ins_ev.address = columnAddress(ins_query, 1);
+        ins_ev.size = columnBytesSize(ins_query, 2);
         ins_ev.time = time;
 
-        sqlite3_bind_int64(mem_query, 1, ins_ev.id[0]);
-
-        while(sqlite3_column_int(mem_query, 1) == ins_ev.id[0])
+        while(sqlite3_column_int64(mem_query, 1) == ins_ev.id[0])
         {
             Event mem_ev;
             mem_ev.id[0] = sqlite3_column_int64(mem_query, 0);
@@ -200,17 +247,85 @@ void SqliteClient::queryEvents()
                 mem_ev.type = EVENT_W;
             else
                 mem_ev.type = EVENT_UFO;
-            mem_ev.address = strtoul((const char*) sqlite3_column_text(mem_query, 3), NULL, 16);
+            mem_ev.address = columnAddress(mem_query, 3);
             mem_ev.size = sqlite3_column_int(mem_query, 4);
             mem_ev.time = time;
 
-            emit receivedEvent(mem_ev);
+            events.append(mem_ev);
             sqlite3_step(mem_query);
         }
 
-        emit receivedEvent(ins_ev);
+        events.append(ins_ev);
         time++;
+        if(events.size() >= EVENT_CHUNK_SIZE)
+        {
+            emit receivedEvents(events);
+            // The view still shares the chunk, start a new one
+            events = QVector<Event>();
+            events.reserve(EVENT_CHUNK_SIZE);
+        }
+    }
+}
+
+void SqliteClient::queryEvents()
+{
+    unsigned long long time = 0;
+    sqlite3_stmt *ins_query, *mem_query;
+    QVector<Event> events;
+    bool stamped = false;
+
+    events.reserve(EVENT_CHUNK_SIZE);
+    // Since SCHEMA_VERSION 4 the threads of TracerPIN are written one buffer
+    // at a time, the stamp of the basic blocks gives the execution order.
+    // Traces of TracerGrind have no stamp and are already in order.
+    if(schema_version >= 4)
+    {
+        sqlite3_stmt *stamp_query;
+        sqlite3_prepare_v2(db, "SELECT EXISTS (SELECT 1 FROM bbl WHERE stamp IS NOT NULL);", -1, &stamp_query, NULL);
+        if(sqlite3_step(stamp_query) == SQLITE_ROW)
+            stamped = sqlite3_column_int(stamp_query, 0) != 0;
+        sqlite3_finalize(stamp_query);
+    }
+    if(stamped)
+    {
+        // Blocks are read through the bbl_stamp index and their instructions
+        // and memory events through ins_bbl_id and mem_ins_id, sorting the
+        // whole tables would need as much temporary storage as the trace
+        sqlite3_stmt *bbl_query;
+        sqlite3_int64 bbl_id = 0;
+        sqlite3_prepare_v2(db, "SELECT rowid FROM bbl ORDER BY stamp;", -1, &bbl_query, NULL);
+        sqlite3_prepare_v2(db, "SELECT ins.rowid, static_ins.ip, static_ins.op FROM ins "
+                               "JOIN static_ins ON static_ins.id = ins.static_ins_id "
+                               "WHERE ins.bbl_id = ? ORDER BY ins.rowid;", -1, &ins_query, NULL);
+        sqlite3_prepare_v2(db, "SELECT mem.rowid, mem.ins_id, mem.type, mem.addr, mem.size FROM ins "
+                               "JOIN mem ON mem.ins_id = ins.rowid "
+                               "WHERE ins.bbl_id = ? ORDER BY ins.rowid, mem.rowid;", -1, &mem_query, NULL);
+        // Instructions traced before the first block of their thread have bbl_id 0
+        while(true)
+        {
+            sqlite3_bind_int64(ins_query, 1, bbl_id);
+            sqlite3_bind_int64(mem_query, 1, bbl_id);
+            readEvents(ins_query, mem_query, events, time);
+            sqlite3_reset(ins_query);
+            sqlite3_reset(mem_query);
+            if(sqlite3_step(bbl_query) != SQLITE_ROW)
+                break;
+            bbl_id = sqlite3_column_int64(bbl_query, 0);
+        }
+        sqlite3_finalize(bbl_query);
     }
+    else
+    {
+        if(schema_version >= 2)
+            sqlite3_prepare_v2(db, "SELECT ins.rowid, static_ins.ip, static_ins.op FROM ins "
+                                   "JOIN static_ins ON static_ins.id = ins.static_ins_id ORDER BY ins.rowid;", -1, &ins_query, NULL);
+        else
+            sqlite3_prepare_v2(db, "SELECT rowid, ip, op FROM ins;", -1, &ins_query, NULL);
+        sqlite3_prepare_v2(db, "SELECT rowid, ins_id, type, addr, size FROM mem;", -1, &mem_query, NULL);
+        readEvents(ins_query, mem_query, events, time);
+    }
+    if(!events.isEmpty())
+        emit receivedEvents(events);
 
     sqlite3_finalize(ins_query);
     sqlite3_finalize(mem_query);
@@ -221,7 +336,11 @@ QString SqliteClient::queryInstDescription(unsigned long long id)
 {
     QString description;
     sqlite3_stmt *query;
-    sqlite3_prepare_v2(db, "SELECT * from INS where rowid=?;", -1, &query, NULL);
+    if(schema_version >= 2)
+        sqlite3_prepare_v2(db, "SELECT ins.bbl_id, static_ins.ip, static_ins.dis, static_ins.op from ins "
+                               "JOIN static_ins ON static_ins.id = ins.static_ins_id WHERE ins.rowid=?;", -1, &query, NULL);
+    else
+        sqlite3_prepare_v2(db, "SELECT * from INS where rowid=?;", -1, &query, NULL);
 
     sqlite3_bind_int64(query, 1, id);
     if(sqlite3_step(query) == SQLITE_ROW)
@@ -232,7 +351,7 @@ QString SqliteClient::queryInstDescription(unsigned long long id)
         {
             description.append(sqlite3_column_name(query, i));
             description.append(": ");
-            description.append((const char*)sqlite3_column_text(query, i));
+            description.append(columnDescription(query, i));
             description.append("\n");
         }
         description.append("\n");
@@ -287,7 +406,7 @@ void SqliteClient::queryEventDescription(Event ev)
             {
                 description.append(sqlite3_column_name(query, i));
                 description.append(": ");
-                description.append((const char*)sqlite3_column_text(query, i));
+                description.append(columnDescription(query, i));
                 description.append("\n");
             }
             description.append("\n");
@@ -319,7 +438,7 @@ void SqliteClient::queryMemoryDumpDescription(Event ev)
 
     while (missing != 0 && sqlite3_step(query) == SQLITE_ROW)
     {
-        unsigned long long address = strtoul((const char*) sqlite3_column_text(query, 2), NULL, 16);
+        unsigned long long address = columnAddress(query, 2);
         unsigned long size = sqlite3_column_int(query, 3);
 
         if (address + size <= ev.address || ev.address + ev.size <= address)
@@ -328,8 +447,13 @@ void SqliteClient::queryMemoryDumpDescription(Event ev)
         }
 
         unsigned long long position = (address<ev.address) ? ev.address : address;
-        const char* data = (const char*) sqlite3_column_text(query, 4);
-        unsigned int lendata = strlen(data);
+        QByteArray hexdata;
+        if(sqlite3_column_type(query, 4) == SQLITE_BLOB)
+            hexdata = QByteArray((const char*) sqlite3_column_blob(query, 4), sqlite3_column_bytes(query, 4)).toHex();
+        else
+            hexdata = QByteArray((const char*) sqlite3_column_text(query, 4));
+        const char* data = hexdata.constData();
+        unsigned int lendata = hexdata.size();
         while (position < address + size && position < ev.address + ev.size) {
             unsigned int positionBuff = (position - ev.address) * 2;
             unsigned int positionData = (position - address) * 2;
@@ -25,6 +25,7 @@
 
 #include <QObject>
 #include <QLinkedList>
+#include <QVector>
 #include <sqlite3.h>
 #include <string.h>
 
@@ -49,6 +50,11 @@ struct Event
 };
 
 Q_DECLARE_METATYPE(Event)
+Q_DECLARE_METATYPE(QVector<Event>)
+
+// Events are sent to the view by chunks, one queued signal per event was
+// slower than processing them
+#define EVENT_CHUNK_SIZE 65536
 
 class SqliteClient : public QObject
 {
@@ -65,7 +71,7 @@ signals:
     void metadataResults(char **metadata);
     void statResults(long long *stats);
     // This HAS to be emited in a time sequential way, or else the event list in the memory blocks won't be sorted.
-    void receivedEvent(Event ev);
+    void receivedEvents(const QVector<Event> &events);
     void receivedEventDescription(const QString &description);
     void dbProcessingFinished();
 
@@ -79,7 +85,11 @@ public slots:
 
 private:
     sqlite3 *db;
+    // 1 for databases without info key SCHEMA_VERSION
+    int schema_version;
 
+    void querySchemaVersion();
+    void readEvents(sqlite3_stmt *ins_query, sqlite3_stmt *mem_query, QVector<Event> &events, unsigned long long &time);
     QString queryInstDescription(unsigned long long id);
     void queryMemoryDumpDescription(Event ev);
 };
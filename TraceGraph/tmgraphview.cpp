@@ -21,6 +21,7 @@
 /* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 /* ===================================================================== */
 #include "tmgraphview.h"
+#include <algorithm>
 
 template <class T>
 const T& min(const T& a, const T& b)
@@ -38,7 +39,135 @@ const T& max(const T& a, const T& b)
     return b;
 }
 
+int MemoryBlock::eventCount() const
+{
+    return times.size();
+}
+
+unsigned long long MemoryBlock::eventTime(int i) const
+{
+    unsigned long long epoch = std::upper_bound(time_epochs.constBegin(), time_epochs.constEnd(), i) - time_epochs.constBegin();
+    return first_time + (epoch << 32) + times[i];
+}
+
+int MemoryBlock::firstEventFrom(unsigned long long time) const
+{
+    if(time <= first_time)
+        return 0;
+    // Only search the events of the 2^32 time span holding that time
+    unsigned long long relative_time = time - first_time;
+    unsigned long long epoch = relative_time >> 32;
+    if(epoch > (unsigned long long) time_epochs.size())
+        return eventCount();
+    int first = epoch == 0 ? 0 : time_epochs[epoch - 1];
+    int last = epoch < (unsigned long long) time_epochs.size() ? time_epochs[epoch] : eventCount();
+    return std::lower_bound(times.constBegin() + first, times.constBegin() + last, (quint32) relative_time) - times.constBegin();
+}
+
+static bool tileBefore(const DensityTile &tile, quint32 span)
+{
+    return tile.span < span;
+}
+
+Event MemoryBlock::event(int i) const
+{
+    Event ev;
+    ev.time = eventTime(i);
+    ev.address = address + offsets[i];
+    ev.size = sizes[i];
+    ev.type = (EVENT_TYPE) types[i];
+    ev.id[0] = ids[i];
+    ev.nbID = 1;
+    QHash<int, qint64>::const_iterator id_it = second_ids.find(i);
+    if(id_it != second_ids.constEnd())
+    {
+        ev.id[1] = id_it.value();
+        ev.nbID = 2;
+    }
+    return ev;
+}
 
+void MemoryBlock::appendEvent(const Event &ev)
+{
+    unsigned long long relative_time = ev.time - first_time;
+    while((relative_time >> 32) > (unsigned long long) time_epochs.size())
+        time_epochs.append(times.size());
+    times.append((quint32) relative_time);
+    offsets.append(ev.address - address);
+    sizes.append(ev.size);
+    types.append(ev.type);
+    ids.append(ev.id[0]);
+    if(ev.nbID > 1)
+        second_ids.insert(times.size() - 1, ev.id[1]);
+}
+
+void MemoryBlock::buildDensity(int levels)
+{
+    density.clear();
+    density.resize(levels);
+    for(int level = 0; level < levels; level++)
+    {
+        unsigned int shift = DENSITY_BASE_SHIFT + DENSITY_LEVEL_SHIFT * level;
+        unsigned long long first_span = first_time >> shift;
+        QVector<DensityTile> &tiles = density[level];
+        if(level == 0)
+        {
+            for(int event_i = 0; event_i < eventCount(); event_i++)
+            {
+                quint32 span = (eventTime(event_i) >> shift) - first_span;
+                if(tiles.isEmpty() || tiles.last().span != span)
+                {
+                    DensityTile tile = {span, 0, 0, 0, 0};
+                    tiles.append(tile);
+                }
+                DensityTile &tile = tiles.last();
+                if(types[event_i] & EVENT_R)
+                    tile.reads++;
+                if(types[event_i] & EVENT_W)
+                    tile.writes++;
+                if(types[event_i] & EVENT_INS)
+                    tile.instructions++;
+                unsigned int first_column = offsets[event_i] / DENSITY_COLUMN_SIZE;
+                unsigned int last_column = (offsets[event_i] + max<unsigned int>(sizes[event_i], 1) - 1) / DENSITY_COLUMN_SIZE;
+                for(unsigned int column = first_column; column <= last_column && column < 64; column++)
+                    tile.columns |= 1ULL << column;
+            }
+        }
+        else
+        {
+            // Merge the tiles of the previous level which fall in the same span
+            unsigned long long previous_first_span = first_time >> (shift - DENSITY_LEVEL_SHIFT);
+            const QVector<DensityTile> &previous_tiles = density[level - 1];
+            for(QVector<DensityTile>::const_iterator tile_it = previous_tiles.constBegin(); tile_it != previous_tiles.constEnd(); tile_it++)
+            {
+                quint32 span = ((previous_first_span + tile_it->span) >> DENSITY_LEVEL_SHIFT) - first_span;
+                if(tiles.isEmpty() || tiles.last().span != span)
+                {
+                    DensityTile tile = {span, 0, 0, 0, 0};
+                    tiles.append(tile);
+                }
+                DensityTile &tile = tiles.last();
+                tile.reads += tile_it->reads;
+                tile.writes += tile_it->writes;
+                tile.instructions += tile_it->instructions;
+                tile.columns |= tile_it->columns;
+            }
+        }
+    }
+}
+
+void MemoryBlock::squeeze()
+{
+    times.squeeze();
+    time_epochs.squeeze();
+    offsets.squeeze();
+    sizes.squeeze();
+    types.squeeze();
+    ids.squeeze();
+    second_ids.squeeze();
+    for(int level = 0; level < density.size(); level++)
+        density[level].squeeze();
+}
 
 TMGraphView::TMGraphView(QWidget *parent) :
     QWidget(parent)
@@ -67,6 +196,7 @@ TMGraphView::TMGraphView(QWidget *parent) :
     time_zoom_factor = 1;
     zoom_state = NO_ZOOM;
     trace_state = NO_DB;
+    density_levels = 0;
     setBackgroundRole(QPalette::Base);
     setAutoFillBackground(true);
     setMouseTracking(true);
@@ -92,16 +222,15 @@ QSize TMGraphView::minimumSizeHint() const
 void TMGraphView::setSqliteClient(SqliteClient *sqlite_client)
 {
     this->sqlite_client = sqlite_client;
-    connect(sqlite_client, &SqliteClient::receivedEvent, this, &TMGraphView::onEventReceived);
+    connect(sqlite_client, &SqliteClient::receivedEvents, this, &TMGraphView::onEventsReceived);
     connect(sqlite_client, &SqliteClient::connectedToDatabase, this, &TMGraphView::onConnectedToDatabase);
     connect(sqlite_client, &SqliteClient::dbProcessingFinished, this, &TMGraphView::onDBProcessingFinished);
 }
 
 void TMGraphView::onConnectedToDatabase()
 {
-    for(QList<MemoryBlock>::iterator block_it = blocks.begin(); block_it != blocks.end(); block_it++)
-        block_it->events.clear();
     blocks.clear();
+    pages.clear();
     trace_state = PROCESSING_DB;
     update();
     displayTrace();
@@ -110,13 +239,20 @@ void TMGraphView::onConnectedToDatabase()
 void TMGraphView::onDBProcessingFinished()
 {
     trace_state = TRACE_READY;
+    sortPages();
     regionProcessing();
     // Automatically show full view upon loading a DB
     zoomToOverview();
     update();
 }
 
-void TMGraphView::onEventReceived(Event ev)
+void TMGraphView::onEventsReceived(const QVector<Event> &events)
+{
+    for(QVector<Event>::const_iterator event_it = events.constBegin(); event_it != events.constEnd(); event_it++)
+        addEvent(*event_it);
+}
+
+void TMGraphView::addEvent(Event ev)
 {
     unsigned long long startAddrBlock = ev.address & 0xFFFFFFFFFFFFF000;
     unsigned long long endAddrBlock = (ev.address + ev.size - 1) & 0xFFFFFFFFFFFFF000;
@@ -129,79 +265,87 @@ void TMGraphView::onEventReceived(Event ev)
       ev.size = ev.size - firstBlocSize;
       ev.address = startAddrBlock + 0x1000;
 
-      onEventReceived(ev2);
+      addEvent(ev2);
       startAddrBlock = ev.address & 0xFFFFFFFFFFFFF000;
     }
 
-    QList<MemoryBlock>::iterator block_it = blocks.begin();
-    bool block_found = false;
-    while(block_it != blocks.end())
-    {
-        // That event fit in that cute little memory block
-        if(ev.address >= block_it->address && ev.address < block_it->address + block_it->size)
-        {
-            block_found = true;
-            break;
-        }
-        else if(ev.address < block_it->address)
-            break; // We went further than the event address without finding a block
-        block_it++;
-    }
+    QHash<unsigned long long, MemoryBlock>::iterator block_it = pages.find(ev.address >> 12);
     // We need to create a new memory block for our event
-    if(!block_found)
+    if(block_it == pages.end())
     {
         MemoryBlock bl;
         // We make block of the same size as memory pages on x86
         bl.address = ev.address&0xFFFFFFFFFFFFF000;
         bl.size = 0x1000;
-        block_it = blocks.insert(block_it, bl);
+        bl.first_time = ev.time;
+        block_it = pages.insert(ev.address >> 12, bl);
     }
+    MemoryBlock &block = block_it.value();
     // merge event if an instruction read and write the same address
     if ((ev.type & (EVENT_R | EVENT_W)) != 0) {
-        QList<Event>::reverse_iterator event_rit = block_it->events.rbegin();
+        int event_i = block.eventCount() - 1;
         bool merge = false;
-        while (event_rit != block_it->events.rend() and event_rit->time == ev.time) {
-            if ((event_rit->type & (EVENT_R | EVENT_W)) == 0) {
-                event_rit++;
+        while (event_i >= 0 and block.eventTime(event_i) == ev.time) {
+            unsigned long long event_addr = block.address + block.offsets[event_i];
+            unsigned long long event_size = block.sizes[event_i];
+            if ((block.types[event_i] & (EVENT_R | EVENT_W)) == 0) {
+                event_i--;
                 continue;
             }
-            if (event_rit->address + event_rit->size <= ev.address) {
-                event_rit++;
+            if (event_addr + event_size <= ev.address) {
+                event_i--;
                 continue;
             }
-            if (ev.address + ev.size <= event_rit->address) {
-                event_rit++;
+            if (ev.address + ev.size <= event_addr) {
+                event_i--;
                 continue;
             }
             // the two event has the same time, a type R|W and the range of
             // address intersect
-            if (event_rit->nbID == sizeof(event_rit->id) / sizeof(event_rit->id[0])){
+            if (block.second_ids.contains(event_i)){
                 // cannot merge the two events
                 break;
             }
             merge = true;
-            unsigned long long start_addr = min(event_rit->address, ev.address);
-            unsigned long long end_addr = max(ev.address + ev.size, event_rit->address + event_rit->size);
+            unsigned long long start_addr = min(event_addr, ev.address);
+            unsigned long long end_addr = max(ev.address + ev.size, event_addr + event_size);
 
-            if ((event_rit->type | ev.type) == EVENT_RW) {
-                event_rit->type = EVENT_RW;
-            }
-            event_rit->address = start_addr;
-            event_rit->size = end_addr - start_addr;
-            event_rit->id[event_rit->nbID] = ev.id[0];
-            event_rit->nbID ++;
+            block.types[event_i] |= ev.type;
+            block.offsets[event_i] = start_addr - block.address;
+            block.sizes[event_i] = end_addr - start_addr;
+            block.second_ids.insert(event_i, ev.id[0]);
             break;
         }
         if (!merge) {
-            block_it->events.append(ev);
+            block.appendEvent(ev);
         }
     } else {
-        block_it->events.append(ev);
+        block.appendEvent(ev);
     }
     if(ev.time > total_time)
         total_time = ev.time;
 }
 
+void TMGraphView::sortPages()
+{
+    // The top level of the density pyramid has a single tile for the whole trace
+    density_levels = 1;
+    while((total_time >> (DENSITY_BASE_SHIFT + DENSITY_LEVEL_SHIFT * (density_levels - 1))) != 0)
+        density_levels++;
+    // The view walks the blocks in address order
+    QList<unsigned long long> page_numbers = pages.keys();
+    std::sort(page_numbers.begin(), page_numbers.end());
+    blocks.reserve(page_numbers.size());
+    for(QList<unsigned long long>::iterator page_it = page_numbers.begin(); page_it != page_numbers.end(); page_it++)
+    {
+        // Taking the block out of the hash lets it drop its spare capacity without a copy
+        MemoryBlock block = pages.take(*page_it);
+        block.buildDensity(density_levels);
+        block.squeeze();
+        blocks.append(block);
+    }
+}
+
 void TMGraphView::regionProcessing()
 {
     // We create display addresses to collapse empty memory region in the view
@@ -279,19 +423,21 @@ Event TMGraphView::findEventAt(QPoint pos)
         else
         {
             // Looking for the right event (if it exist)
-            for(QList<Event>::iterator event_it = block_it->events.begin(); event_it != block_it->events.end(); event_it++)
+            for(int event_i = block_it->firstEventFrom(min_time); event_i < block_it->eventCount(); event_i++)
             {
-                if(max_time < event_it->time)
+                unsigned long long event_time = block_it->eventTime(event_i);
+                unsigned long long event_addr = block_it->address + block_it->offsets[event_i];
+                if(max_time < event_time)
                 {
                     break; // We are too far in time
                 }
-                else if(event_it->time < min_time)
+                else if(event_time < min_time)
                 {
                     continue;
                 }
-                else if(event_it->address <= max_address && min_address < event_it->address + event_it->size)
+                else if(event_addr <= max_address && min_address < event_addr + block_it->sizes[event_i])
                 {
-                    return *event_it; // Found it!
+                    return block_it->event(event_i); // Found it!
                 }
             }
         }
@@ -653,6 +799,154 @@ void TMGraphView::paintOneEvent(const Event& event, unsigned long windows_addr_s
     painter->drawRect(x, y, width, height);
 }
 
+int TMGraphView::densityLevel()
+{
+    // Below a level 0 tile per pixel the events themselves are accumulated
+    double pixel_time = 1.0 / time_zoom_factor;
+    if(density_levels == 0 || pixel_time < (1ULL << DENSITY_BASE_SHIFT))
+        return -1;
+    // Use the coarsest level whose tiles are not taller than a pixel
+    int level = 0;
+    while(level + 1 < density_levels &&
+          (double)(1ULL << (DENSITY_BASE_SHIFT + DENSITY_LEVEL_SHIFT * (level + 1))) <= pixel_time)
+        level++;
+    return level;
+}
+
+// Set the pixels covered by the display addresses [start_addr, end_addr[,
+// return false if they are out of the view
+bool TMGraphView::pixelRange(unsigned long long start_addr, unsigned long long end_addr, unsigned long windows_addr_size, int &x0, int &x1)
+{
+    if(end_addr <= view_address || start_addr > view_address + windows_addr_size)
+        return false;
+    x0 = start_addr < view_address ? 0 : (int)((start_addr - view_address) * address_zoom_factor);
+    x1 = (int)ceil((end_addr - view_address) * address_zoom_factor);
+    x1 = min(max(x1, x0 + 1), width());
+    return true;
+}
+
+// Level -1 accumulates the events, when a pixel covers more than one
+// instruction but less than a level 0 tile
+void TMGraphView::paintDensity(int level, unsigned long windows_addr_size, unsigned long windows_time_size)
+{
+    int image_width = width(), image_height = height();
+    unsigned int shift = DENSITY_BASE_SHIFT + DENSITY_LEVEL_SHIFT * level;
+    if(image_width <= 0 || image_height <= 0)
+        return;
+    // Accumulate the tiles of the view in a count per pixel
+    QVector<quint32> reads(image_width * image_height, 0);
+    QVector<quint32> writes(image_width * image_height, 0);
+    QVector<quint32> instructions(image_width * image_height, 0);
+    for(QList<MemoryBlock>::iterator block_it = blocks.begin(); block_it != blocks.end(); block_it++)
+    {
+        if(block_it->display_address > view_address + windows_addr_size)
+            break;
+        else if(block_it->display_address + block_it->size <= view_address)
+            continue;
+        if(level < 0)
+        {
+            for(int event_i = block_it->firstEventFrom(view_time); event_i < block_it->eventCount(); event_i++)
+            {
+                unsigned long long event_time = block_it->eventTime(event_i);
+                if(event_time > view_time + windows_time_size)
+                    break;
+                int y = (int)((event_time - view_time) * time_zoom_factor);
+                if(y >= image_height)
+                    break;
+                unsigned long long start_addr = block_it->display_address + block_it->offsets[event_i];
+                int x0, x1;
+                if(!pixelRange(start_addr, start_addr + max<unsigned int>(block_it->sizes[event_i], 1), windows_addr_size, x0, x1))
+                    continue;
+                for(int x = x0; x < x1; x++)
+                {
+                    if(block_it->types[event_i] & EVENT_R)
+                        reads[y * image_width + x]++;
+                    if(block_it->types[event_i] & EVENT_W)
+                        writes[y * image_width + x]++;
+                    if(block_it->types[event_i] & EVENT_INS)
+                        instructions[y * image_width + x]++;
+                }
+            }
+            continue;
+        }
+        const QVector<DensityTile> &tiles = block_it->density[level];
+        unsigned long long first_span = block_it->first_time >> shift;
+        QVector<DensityTile>::const_iterator tile_it = tiles.constBegin();
+        if((view_time >> shift) > first_span)
+            tile_it = std::lower_bound(tiles.constBegin(), tiles.constEnd(), (quint32) ((view_time >> shift) - first_span), tileBefore);
+        for(; tile_it != tiles.constEnd(); tile_it++)
+        {
+            unsigned long long tile_time = (first_span + tile_it->span) << shift;
+            if(tile_time > view_time + windows_time_size)
+                break;
+            else if(tile_time + (1ULL << shift) <= view_time)
+                continue;
+            int y = tile_time < view_time ? 0 : (int)((tile_time - view_time) * time_zoom_factor);
+            if(y >= image_height)
+                break;
+            // Each run of touched columns covers a range of pixels
+            int column = 0;
+            while(column < 64)
+            {
+                if(((tile_it->columns >> column) & 1) == 0)
+                {
+                    column++;
+                    continue;
+                }
+                int run_end = column;
+                while(run_end < 64 && ((tile_it->columns >> run_end) & 1))
+                    run_end++;
+                unsigned long long run_start_addr = block_it->display_address + column * DENSITY_COLUMN_SIZE;
+                unsigned long long run_end_addr = block_it->display_address + run_end * DENSITY_COLUMN_SIZE;
+                column = run_end;
+                int x0, x1;
+                if(!pixelRange(run_start_addr, run_end_addr, windows_addr_size, x0, x1))
+                    continue;
+                for(int x = x0; x < x1; x++)
+                {
+                    reads[y * image_width + x] += tile_it->reads;
+                    writes[y * image_width + x] += tile_it->writes;
+                    instructions[y * image_width + x] += tile_it->instructions;
+                }
+            }
+        }
+    }
+    // Pixels take the color of the events they hold, denser ones are more opaque
+    quint32 max_count = 0;
+    for(int i = 0; i < image_width * image_height; i++)
+        max_count = max(max_count, reads[i] + writes[i] + instructions[i]);
+    if(max_count == 0)
+        return;
+    double log_max_count = log(1.0 + max_count);
+    QImage image(image_width, image_height, QImage::Format_ARGB32);
+    for(int y = 0; y < image_height; y++)
+    {
+        QRgb *line = (QRgb*) image.scanLine(y);
+        for(int x = 0; x < image_width; x++)
+        {
+            int i = y * image_width + x;
+            quint32 count = reads[i] + writes[i] + instructions[i];
+            if(count == 0)
+            {
+                line[x] = qRgba(0, 0, 0, 0);
+                continue;
+            }
+            QColor color;
+            if(reads[i] != 0 && writes[i] != 0)
+                color = rwbrush.color();
+            else if(writes[i] != 0)
+                color = wbrush.color();
+            else if(reads[i] != 0)
+                color = rbrush.color();
+            else
+                color = ibrush.color();
+            int alpha = 64 + (int)(191 * log(1.0 + count) / log_max_count);
+            line[x] = qRgba(color.red(), color.green(), color.blue(), alpha);
+        }
+    }
+    painter->drawImage(0, 0, image);
+}
+
 void TMGraphView::paintEvent(QPaintEvent* /*event*/)
 {
     unsigned long current_windows_addr_size = (unsigned long)this->width()/address_zoom_factor;
@@ -662,6 +956,11 @@ void TMGraphView::paintEvent(QPaintEvent* /*event*/)
     // We adapt the size to keep each event size above 1px if the zoom is too low
     if(trace_state == TRACE_READY)
     {
+        int density_level = densityLevel();
+        // Events are drawn once they cover at least a pixel
+        bool draw_events = time_zoom_factor >= 1.0;
+        if(!draw_events)
+            paintDensity(density_level, current_windows_addr_size, current_windows_time_size);
         if (display_ptr_event && ptr_event.time >= view_time && ptr_event.time < view_time + current_windows_time_size)
         {
             paintOneEvent(ptr_event, current_windows_addr_size);
@@ -684,16 +983,17 @@ void TMGraphView::paintEvent(QPaintEvent* /*event*/)
                      snprintf(address_str, 64, "0x%llx", block_it->address);
                      painter->drawText((block_it->display_address - view_address)*address_zoom_factor, height(), address_str);
                  }
-                 QList<Event>::iterator event_it = block_it->events.begin();
-                 while(event_it != block_it->events.end())
+                 int event_i = block_it->firstEventFrom(view_time);
+                 while(draw_events && event_i < block_it->eventCount())
                  {
-                     if(event_it->time > view_time + current_windows_time_size)
+                     unsigned long long event_time = block_it->eventTime(event_i);
+                     if(event_time > view_time + current_windows_time_size)
                          break;
-                     else if(event_it->time >= view_time)
+                     else if(event_time >= view_time)
                      {
-                         paintOneEvent(*event_it, current_windows_addr_size);
+                         paintOneEvent(block_it->event(event_i), current_windows_addr_size);
                      }
-                     event_it++;
+                     event_i++;
                  }
              }
              block_it++;
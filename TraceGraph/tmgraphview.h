@@ -27,7 +27,10 @@
 #include <QSize>
 #include <QWheelEvent>
 #include <QPainter>
+#include <QImage>
 #include <QList>
+#include <QVector>
+#include <QHash>
 #include <QBrush>
 #include <QPen>
 #include <QColor>
@@ -51,11 +54,50 @@ enum TraceState
     TRACE_READY
 };
 
+// Zoomed out views are drawn from a density pyramid instead of the events.
+// Level 0 counts the events of a block by spans of 2^DENSITY_BASE_SHIFT
+// instructions, each level groups 2^DENSITY_LEVEL_SHIFT spans of the previous
+// one. Blocks are split in 64 columns to keep some address resolution.
+#define DENSITY_BASE_SHIFT 8
+#define DENSITY_LEVEL_SHIFT 2
+#define DENSITY_COLUMN_SIZE (0x1000 / 64)
+
+struct DensityTile
+{
+    // Time span, relative to the one of the first event of the block
+    quint32 span;
+    quint32 reads, writes, instructions;
+    // Columns touched by the events of the span
+    quint64 columns;
+};
+
+// The events of a memory block are stored by columns, in time order. Times
+// are relative to the first event of the block and only their low 32 bits
+// are stored, time_epochs holds the index of the first event of each
+// following 2^32 time span. Addresses are offsets in the block. Only merged
+// read and write events have a second id, they are kept aside.
 struct MemoryBlock
 {
     unsigned long long address, size, display_address;
     bool start_region;
-    QList<Event> events;
+    unsigned long long first_time;
+    QVector<quint32> times;
+    QVector<int> time_epochs;
+    QVector<quint16> offsets;
+    QVector<quint16> sizes;
+    QVector<quint8> types;
+    QVector<qint64> ids;
+    QHash<int, qint64> second_ids;
+    // One list of non empty tiles per density level, in time order
+    QVector<QVector<DensityTile> > density;
+
+    int eventCount() const;
+    unsigned long long eventTime(int i) const;
+    int firstEventFrom(unsigned long long time) const;
+    Event event(int i) const;
+    void appendEvent(const Event &ev);
+    void buildDensity(int levels);
+    void squeeze();
 };
 
 struct Region
@@ -84,7 +126,7 @@ signals:
     void eventDescriptionQueried(Event ev);
 
 public slots:
-    void onEventReceived(Event ev);
+    void onEventsReceived(const QVector<Event> &events);
     void onConnectedToDatabase();
     void onDBProcessingFinished();
     void onWindowResize();
@@ -99,6 +141,10 @@ private:
     double address_zoom_factor, time_zoom_factor;
     unsigned long long size_border;
     QList<MemoryBlock> blocks;
+    // Blocks indexed by page number while the events are received, they are
+    // sorted into blocks once the database is processed
+    QHash<unsigned long long, MemoryBlock> pages;
+    int density_levels;
     QList<Region> regions;
     ZoomState zoom_state;
     TraceState trace_state;
@@ -107,6 +153,8 @@ private:
     bool display_ptr_event, draw_ptr_event;
     Event ptr_event;
 
+    void addEvent(Event ev);
+    void sortPages();
     void setColor(EVENT_TYPE type);
     void regionProcessing();
     unsigned long long realAddressToDisplayAddress(unsigned long long address);
@@ -114,6 +162,9 @@ private:
     Event findEventAt(const QPoint pos);
     void updateZoomFactors();
     void paintOneEvent(const Event& e, unsigned long windows_addr_size);
+    int densityLevel();
+    bool pixelRange(unsigned long long start_addr, unsigned long long end_addr, unsigned long windows_addr_size, int &x0, int &x1);
+    void paintDensity(int level, unsigned long windows_addr_size, unsigned long windows_time_size);
     void setPtrEvent(QMouseEvent * event);
 
 protected:
@@ -0,0 +1,148 @@
+/* ===================================================================== */
+/* This file is part of TracerGrind                                      */
+/* TracerGrind is an execution tracing module for Valgrind               */
+/* Copyright (C) 2016                                                    */
+/* Original author:   Charles Hubain <me@haxelion.eu>                    */
+/* Contributors:      Phil Teuwen <phil@teuwen.org>                      */
+/*                    Joppe Bos <joppe_bos@hotmail.com>                  */
+/*                    Wil Michiels <w.p.a.j.michiels@tue.nl>             */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* any later version.                                                    */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/* ===================================================================== */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "disasm_cache.h"
+
+static uint64_t code_hash(const uint8_t *code, uint64_t length)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t i;
+    for(i = 0; i < length; i++)
+        h = (h ^ code[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static size_t block_slot(const DisasmCache *cache, uint64_t address, cs_mode mode, uint64_t hash)
+{
+    uint64_t h = hash ^ address ^ ((uint64_t)mode << 56);
+    return (size_t)(h ^ (h >> 29)) & (cache->capacity-1);
+}
+
+void disasm_cache_init(DisasmCache *cache)
+{
+    memset(cache, 0, sizeof(DisasmCache));
+}
+
+void disasm_cache_open(DisasmCache *cache, csh handle, cs_mode mode)
+{
+    cache->handle = handle;
+    cache->mode = mode;
+}
+
+void disasm_cache_free(DisasmCache *cache)
+{
+    size_t i;
+    for(i = 0; i < cache->capacity; i++)
+        free(cache->table[i]);
+    free(cache->table);
+    memset(cache, 0, sizeof(DisasmCache));
+}
+
+// The block, its instructions, a copy of its code and its strings are
+// stored in a single allocation
+static DisasmBlock* disassemble(DisasmCache *cache, uint64_t address, cs_mode mode,
+                                const uint8_t *code, uint64_t length, uint64_t hash)
+{
+    DisasmBlock *block;
+    cs_insn *insn;
+    size_t i, count, size;
+    uint8_t *code_copy;
+    char *p;
+
+    if(mode != cache->mode)
+    {
+        cs_option(cache->handle, CS_OPT_MODE, mode);
+        cache->mode = mode;
+    }
+    count = cs_disasm_ex(cache->handle, code, length, address, 0, &insn);
+    size = sizeof(DisasmBlock) + count*sizeof(DisasmIns) + length;
+    for(i = 0; i < count; i++)
+        size += 2*(strlen(insn[i].mnemonic) + strlen(insn[i].op_str) + 2);
+    block = (DisasmBlock*) malloc(size);
+    block->address = address;
+    block->mode = mode;
+    block->hash = hash;
+    block->length = length;
+    block->count = count;
+    block->ins = (DisasmIns*) (block + 1);
+    code_copy = (uint8_t*) (block->ins + count);
+    memcpy(code_copy, code, length);
+    block->code = code_copy;
+    p = (char*) (code_copy + length);
+    for(i = 0; i < count; i++)
+    {
+        DisasmIns *ins = &(block->ins[i]);
+        ins->address = insn[i].address;
+        ins->size = insn[i].size;
+        ins->bytes = code_copy + (insn[i].address - address);
+        ins->mnemonic = p;
+        p += sprintf(p, "%s", insn[i].mnemonic) + 1;
+        ins->op_str = p;
+        p += sprintf(p, "%s", insn[i].op_str) + 1;
+        ins->text = p;
+        p += sprintf(p, "%s %s", insn[i].mnemonic, insn[i].op_str) + 1;
+    }
+    cs_free(insn, count);
+    return block;
+}
+
+const DisasmBlock* disasm_cache_get(DisasmCache *cache, uint64_t address, cs_mode mode,
+                                    const uint8_t *code, uint64_t length)
+{
+    uint64_t hash = code_hash(code, length);
+    size_t i, slot;
+    DisasmBlock *block;
+
+    // Keep the load factor under 1/2
+    if(2*(cache->count+1) > cache->capacity)
+    {
+        DisasmBlock **old_table = cache->table;
+        size_t old_capacity = cache->capacity;
+        cache->capacity = old_capacity ? 2*old_capacity : 4096;
+        cache->table = (DisasmBlock**) calloc(cache->capacity, sizeof(DisasmBlock*));
+        for(i = 0; i < old_capacity; i++)
+        {
+            if(old_table[i] == NULL)
+                continue;
+            slot = block_slot(cache, old_table[i]->address, old_table[i]->mode, old_table[i]->hash);
+            while(cache->table[slot] != NULL)
+                slot = (slot+1) & (cache->capacity-1);
+            cache->table[slot] = old_table[i];
+        }
+        free(old_table);
+    }
+    slot = block_slot(cache, address, mode, hash);
+    while((block = cache->table[slot]) != NULL)
+    {
+        if(block->address == address && block->mode == mode && block->hash == hash &&
+           block->length == length && memcmp(block->code, code, length) == 0)
+            return block;
+        slot = (slot+1) & (cache->capacity-1);
+    }
+    block = disassemble(cache, address, mode, code, length, hash);
+    cache->table[slot] = block;
+    cache->count++;
+    return block;
+}
@@ -0,0 +1,73 @@
+/* ===================================================================== */
+/* This file is part of TracerGrind                                      */
+/* TracerGrind is an execution tracing module for Valgrind               */
+/* Copyright (C) 2016                                                    */
+/* Original author:   Charles Hubain <me@haxelion.eu>                    */
+/* Contributors:      Phil Teuwen <phil@teuwen.org>                      */
+/*                    Joppe Bos <joppe_bos@hotmail.com>                  */
+/*                    Wil Michiels <w.p.a.j.michiels@tue.nl>             */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* any later version.                                                    */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/* ===================================================================== */
+#ifndef DISASM_CACHE_H
+#define DISASM_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <capstone/capstone.h>
+
+typedef struct _DisasmIns
+{
+    uint64_t address;
+    uint16_t size;
+    const uint8_t *bytes;
+    const char *mnemonic;
+    const char *op_str;
+    // "mnemonic op_str"
+    const char *text;
+} DisasmIns;
+
+typedef struct _DisasmBlock
+{
+    uint64_t address;
+    cs_mode mode;
+    uint64_t hash;
+    uint64_t length;
+    const uint8_t *code;
+    size_t count;
+    DisasmIns *ins;
+} DisasmBlock;
+
+// Blocks are disassembled once and kept with their rendered strings,
+// a block executed again with the same code does not go through Capstone
+typedef struct _DisasmCache
+{
+    csh handle;
+    cs_mode mode;
+    DisasmBlock **table;
+    size_t capacity;
+    size_t count;
+} DisasmCache;
+
+void disasm_cache_init(DisasmCache *cache);
+// Set the Capstone handle opened in mode, the cache does not close it
+void disasm_cache_open(DisasmCache *cache, csh handle, cs_mode mode);
+void disasm_cache_free(DisasmCache *cache);
+
+// Return the disassembly of the code of a block, the result stays valid
+// until disasm_cache_free()
+const DisasmBlock* disasm_cache_get(DisasmCache *cache, uint64_t address, cs_mode mode,
+                                    const uint8_t *code, uint64_t length);
+
+#endif // DISASM_CACHE_H
@@ -0,0 +1,636 @@
+/* ===================================================================== */
+/* This file is part of TracerGrind                                      */
+/* TracerGrind is an execution tracing module for Valgrind               */
+/* Copyright (C) 2016                                                    */
+/* Original author:   Charles Hubain <me@haxelion.eu>                    */
+/* Contributors:      Phil Teuwen <phil@teuwen.org>                      */
+/*                    Joppe Bos <joppe_bos@hotmail.com>                  */
+/*                    Wil Michiels <w.p.a.j.michiels@tue.nl>             */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* any later version.                                                    */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/* ===================================================================== */
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace_reader.h"
+
+#define READ_AHEAD_SIZE (16*1024*1024)
+// Pages of the mapping already parsed are given back every RELEASE_SIZE
+// bytes so that a large trace does not fill the memory
+#define RELEASE_SIZE (64*1024*1024)
+
+static uint64_t get_u64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// Read exactly size bytes unless the end of the file is reached
+static size_t read_full(int fd, uint8_t *data, size_t size)
+{
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t n = read(fd, data + done, size - done);
+        if(n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+// Read the next block of a compressed trace, return 0 at the end of the
+// trace and -1 if it is corrupted
+static int read_block(TraceReader *reader)
+{
+    uint8_t header[TRACE_COMPRESS_HEADER_SIZE];
+    uint32_t raw_size, compressed_size;
+    size_t n = read_full(reader->fd, header, TRACE_COMPRESS_HEADER_SIZE);
+    if(n == 0)
+        return 0;
+    if(n < TRACE_COMPRESS_HEADER_SIZE)
+        return -1;
+    raw_size = trace_compress_get32(header);
+    compressed_size = trace_compress_get32(&(header[4]));
+    if(raw_size > TRACE_COMPRESS_BLOCK_SIZE || compressed_size > TRACE_COMPRESS_BOUND(raw_size))
+        return -1;
+    if(compressed_size == raw_size)
+    {
+        if(read_full(reader->fd, reader->raw_block, raw_size) != raw_size)
+            return -1;
+    }
+    else if(read_full(reader->fd, reader->block, compressed_size) != compressed_size ||
+            trace_decompress(reader->block, compressed_size, reader->raw_block, raw_size) != 0)
+        return -1;
+    reader->raw_block_size = raw_size;
+    reader->raw_block_position = 0;
+    return 1;
+}
+
+// Read up to size bytes of the trace, decompressing it if needed
+static size_t read_trace(TraceReader *reader, uint8_t *data, size_t size)
+{
+    size_t done = 0;
+    if(!reader->compressed)
+    {
+        ssize_t n = read(reader->fd, data, size);
+        return n > 0 ? n : 0;
+    }
+    while(done < size)
+    {
+        size_t n;
+        if(reader->raw_block_position == reader->raw_block_size)
+        {
+            int status = read_block(reader);
+            if(status < 0)
+                printf("Corrupted compressed block.\n");
+            if(status <= 0)
+                break;
+        }
+        n = reader->raw_block_size - reader->raw_block_position;
+        if(n > size - done)
+            n = size - done;
+        memcpy(data + done, reader->raw_block + reader->raw_block_position, n);
+        reader->raw_block_position += n;
+        done += n;
+    }
+    return done;
+}
+
+int trace_reader_open(TraceReader *reader, const char *filename)
+{
+    struct stat st;
+    uint8_t magic[sizeof(TRACE_COMPRESS_MAGIC)];
+    size_t n;
+
+    memset(reader, 0, sizeof(TraceReader));
+    reader->protocol = 1;
+    reader->fd = open(filename, O_RDONLY);
+    if(reader->fd < 0)
+        return -1;
+    // Compressed traces are decompressed in the read-ahead buffer
+    n = read_full(reader->fd, magic, sizeof(magic));
+    if(n == sizeof(magic) && memcmp(magic, TRACE_COMPRESS_MAGIC, sizeof(magic)) == 0)
+    {
+        reader->compressed = 1;
+        reader->block = (uint8_t*) malloc(TRACE_COMPRESS_BOUND(TRACE_COMPRESS_BLOCK_SIZE));
+        reader->raw_block = (uint8_t*) malloc(TRACE_COMPRESS_BLOCK_SIZE);
+    }
+    // Pipes and files too large for the address space are read instead
+    else if(fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (uint64_t)st.st_size <= (size_t)-1)
+    {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if(map != MAP_FAILED)
+        {
+            reader->mapped = 1;
+            reader->map = (uint8_t*) map;
+            reader->map_size = st.st_size;
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            return 0;
+        }
+    }
+    reader->buffer_capacity = READ_AHEAD_SIZE;
+    reader->buffer = (uint8_t*) malloc(reader->buffer_capacity);
+    // The bytes read while looking for the magic belong to the trace
+    if(!reader->compressed)
+    {
+        memcpy(reader->buffer, magic, n);
+        reader->buffer_size = n;
+    }
+    return 0;
+}
+
+void trace_reader_close(TraceReader *reader)
+{
+    uint64_t i;
+    if(reader->mapped)
+        munmap(reader->map, (size_t)reader->map_size);
+    free(reader->buffer);
+    free(reader->block);
+    free(reader->raw_block);
+    free(reader->addresses);
+    for(i = 0; i < reader->block_count; i++)
+        free(reader->blocks[i]);
+    free(reader->blocks);
+    close(reader->fd);
+}
+
+// Make sure size bytes are available at the current position of the buffer
+static int fill_buffer(TraceReader *reader, size_t size)
+{
+    size_t available = reader->buffer_size - reader->position;
+    if(available >= size)
+        return 1;
+    memmove(reader->buffer, reader->buffer + reader->position, available);
+    reader->buffer_size = available;
+    reader->position = 0;
+    if(size > reader->buffer_capacity)
+    {
+        while(size > reader->buffer_capacity)
+            reader->buffer_capacity *= 2;
+        reader->buffer = (uint8_t*) realloc(reader->buffer, reader->buffer_capacity);
+    }
+    while(reader->buffer_size < reader->buffer_capacity && !reader->eof)
+    {
+        size_t n = read_trace(reader, reader->buffer + reader->buffer_size,
+                              reader->buffer_capacity - reader->buffer_size);
+        if(n == 0)
+            reader->eof = 1;
+        else
+            reader->buffer_size += n;
+    }
+    return reader->buffer_size >= size;
+}
+
+// Return the size of the message header at p, 0 if it does not fit in
+// available bytes
+static int parse_header(TraceReader *reader, const uint8_t *p, uint64_t available, Msg *msg)
+{
+    if(available == 0)
+        return 0;
+    msg->type = p[0];
+    if(reader->protocol >= 2)
+    {
+        uint64_t length;
+        int n = getVarint(p + 1, p + available, &length);
+        if(n == 0 || length > (uint64_t)-1 - MSG_HEADER_MAX_SIZE)
+            return 0;
+        msg->length = 1 + n + length;
+        return 1 + n;
+    }
+    if(available < MSG_HEADER_SIZE)
+        return 0;
+    msg->length = get_u64(p + 1);
+    return MSG_HEADER_SIZE;
+}
+
+// The PROTOCOL info message changes the encoding of the next messages
+static int check_protocol(TraceReader *reader, const Msg *msg)
+{
+    size_t size = msg->length - reader->header_size;
+    size_t key_size = strlen(STR_PROTOCOL) + 1;
+    int protocol;
+    if(msg->type != MSG_INFO || size <= key_size || memcmp(msg->data, STR_PROTOCOL, key_size) != 0 ||
+       memchr(msg->data + key_size, '\0', size - key_size) == NULL)
+        return 0;
+    protocol = atoi((const char*) msg->data + key_size);
+    if(protocol < 1 || protocol > PROTOCOL_VERSION_MAX)
+    {
+        printf("Unsupported trace protocol %s.\n", (const char*) msg->data + key_size);
+        return -1;
+    }
+    reader->protocol = protocol;
+    return 0;
+}
+
+static int read_msg(TraceReader *reader, Msg *msg)
+{
+    const uint8_t *header;
+    uint64_t available;
+    int header_size;
+
+    reader->offset = reader->next_offset;
+    if(reader->mapped)
+    {
+        available = reader->map_size - reader->position;
+        if(reader->position - reader->released >= RELEASE_SIZE)
+        {
+            uint64_t end = reader->position & ~(uint64_t)(RELEASE_SIZE-1);
+            madvise(reader->map + reader->released, (size_t)(end - reader->released), MADV_DONTNEED);
+            reader->released = end;
+        }
+        if(available == 0)
+            return 0;
+        header = reader->map + reader->position;
+        header_size = parse_header(reader, header, available, msg);
+        if(header_size == 0 || msg->length < header_size || msg->length > available)
+            goto truncated;
+    }
+    else
+    {
+        fill_buffer(reader, MSG_HEADER_MAX_SIZE);
+        available = reader->buffer_size - reader->position;
+        if(available == 0)
+            return 0;
+        header = reader->buffer + reader->position;
+        header_size = parse_header(reader, header, available, msg);
+        if(header_size == 0 || msg->length < header_size || msg->length > (size_t)-1 ||
+           !fill_buffer(reader, msg->length))
+            goto truncated;
+        header = reader->buffer + reader->position;
+    }
+    msg->data = (uint8_t*) header + header_size;
+    reader->header_size = header_size;
+    reader->position += msg->length;
+    reader->next_offset += msg->length;
+    if(reader->protocol == 1 && check_protocol(reader, msg) != 0)
+        return -1;
+    return 1;
+
+truncated:
+    printf("Truncated message at offset %llu.\n", (unsigned long long) reader->offset);
+    return -1;
+}
+
+static int store_block(TraceReader *reader, const Msg *msg);
+static int start_range(TraceReader *reader, const Msg *msg);
+
+int trace_reader_next(TraceReader *reader, Msg *msg)
+{
+    int status;
+    if(reader->range_left == 0)
+    {
+        reader->range_piece = 0;
+        // Block definitions are kept by the reader and not returned
+        while((status = read_msg(reader, msg)) > 0 && reader->protocol >= 3 && msg->type == MSG_BLOCK)
+        {
+            if(store_block(reader, msg) != 0)
+            {
+                printf("Invalid BlockMsg at offset %llu.\n", (unsigned long long) reader->offset);
+                return -1;
+            }
+        }
+        if(status <= 0 || reader->protocol < 4 || msg->type != MSG_MEMORY_RANGE)
+            return status;
+        if(start_range(reader, msg) != 0)
+        {
+            printf("Invalid MemoryRangeMsg at offset %llu.\n", (unsigned long long) reader->offset);
+            return -1;
+        }
+    }
+    // The accesses of a range are decoded by trace_read_memory()
+    reader->range_piece = 1;
+    reader->range_left--;
+    msg->type = MSG_MEMORY;
+    msg->length = reader->header_size;
+    msg->data = NULL;
+    return 1;
+}
+
+// Return the length of a string inside a message including its terminator,
+// 0 if it is not terminated
+static size_t get_cstr(const uint8_t *data, size_t size)
+{
+    const uint8_t *end = (const uint8_t*) memchr(data, '\0', size);
+    if(end == NULL)
+        return 0;
+    return end - data + 1;
+}
+
+// Read a varint of a protocol 2 message and move p after it, return -1 if
+// the message ends before it
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    int n = getVarint(*p, end, v);
+    if(n == 0)
+        return -1;
+    *p += n;
+    return 0;
+}
+
+static int get_delta(const uint8_t **p, const uint8_t *end, uint64_t *last)
+{
+    uint64_t v;
+    if(get_varint(p, end, &v) != 0)
+        return -1;
+    *last += zigzagDecode(v);
+    return 0;
+}
+
+int trace_read_info(TraceReader *reader, const Msg *msg, InfoMsg *imsg)
+{
+    size_t size = msg->length - reader->header_size;
+    size_t key_size, value_size;
+    key_size = get_cstr(msg->data, size);
+    if(key_size == 0)
+        return -1;
+    value_size = get_cstr(msg->data + key_size, size - key_size);
+    if(value_size == 0)
+        return -1;
+    imsg->key = (const char*) msg->data;
+    imsg->value = (const char*) msg->data + key_size;
+    return 0;
+}
+
+int trace_read_lib(TraceReader *reader, const Msg *msg, LibMsg *lmsg)
+{
+    size_t size = msg->length - reader->header_size;
+    const uint8_t *p = msg->data, *end = msg->data + size;
+    if(reader->protocol >= 2)
+    {
+        if(get_varint(&p, end, &(lmsg->base)) != 0 || get_varint(&p, end, &(lmsg->end)) != 0)
+            return -1;
+    }
+    else
+    {
+        if(size < 16)
+            return -1;
+        lmsg->base = get_u64(p);
+        lmsg->end = get_u64(p + 8);
+        p += 16;
+    }
+    if(get_cstr(p, end - p) == 0)
+        return -1;
+    lmsg->name = (const char*) p;
+    return 0;
+}
+
+static void reserve_addresses(TraceReader *reader, uint64_t number)
+{
+    if(number > reader->max_addresses)
+    {
+        reader->max_addresses = number;
+        reader->addresses = (uint64_t*) realloc(reader->addresses, reader->max_addresses*8);
+    }
+}
+
+// Decode the number, length, addresses, lengths and code of a protocol 2
+// block into emsg, the addresses go to reader->addresses
+static int get_block(TraceReader *reader, const uint8_t *p, const uint8_t *end, ExecMsg *emsg)
+{
+    uint64_t i, size = end - p;
+    if(get_varint(&p, end, &(emsg->number)) != 0 || get_varint(&p, end, &(emsg->length)) != 0 ||
+       emsg->number > size || emsg->length > size)
+        return -1;
+    reserve_addresses(reader, emsg->number);
+    // The deltas come before the lengths they are relative to
+    for(i = 0; i < emsg->number; i++)
+    {
+        uint64_t delta;
+        if(get_varint(&p, end, &delta) != 0)
+            return -1;
+        reader->addresses[i] = zigzagDecode(delta);
+    }
+    if((uint64_t)(end - p) != emsg->number + emsg->length)
+        return -1;
+    emsg->lengths = (uint8_t*) p;
+    if(emsg->number > 0)
+    {
+        reader->last_block_address += reader->addresses[0];
+        reader->addresses[0] = reader->last_block_address;
+    }
+    for(i = 1; i < emsg->number; i++)
+        reader->addresses[i] += reader->addresses[i-1] + emsg->lengths[i-1];
+    return 0;
+}
+
+// Keep a copy of the block defined by a protocol 3 BlockMsg
+static int store_block(TraceReader *reader, const Msg *msg)
+{
+    size_t size = msg->length - reader->header_size;
+    const uint8_t *p = msg->data, *end = msg->data + size;
+    uint64_t block_id;
+    ExecMsg emsg;
+    BlockMsg *block;
+    // Blocks are defined in the order of their ids
+    if(get_varint(&p, end, &block_id) != 0 || block_id != reader->block_count ||
+       get_block(reader, p, end, &emsg) != 0)
+        return -1;
+    if(reader->block_count == reader->max_blocks)
+    {
+        reader->max_blocks = reader->max_blocks ? 2*reader->max_blocks : 4096;
+        reader->blocks = (BlockMsg**) realloc(reader->blocks, reader->max_blocks*sizeof(BlockMsg*));
+    }
+    // The definition, its addresses, lengths and code in a single allocation
+    block = (BlockMsg*) malloc(sizeof(BlockMsg) + emsg.number*9 + emsg.length);
+    block->block_id = block_id;
+    block->number = emsg.number;
+    block->length = emsg.length;
+    block->addresses = (uint64_t*) (block + 1);
+    block->lengths = (uint8_t*) (block->addresses + emsg.number);
+    block->code = block->lengths + emsg.number;
+    memcpy(block->addresses, reader->addresses, emsg.number*8);
+    memcpy(block->lengths, emsg.lengths, emsg.number + emsg.length);
+    reader->blocks[reader->block_count++] = block;
+    return 0;
+}
+
+int trace_read_exec(TraceReader *reader, const Msg *msg, ExecMsg *emsg)
+{
+    size_t size = msg->length - reader->header_size;
+    const uint8_t *p = msg->data, *end = msg->data + size;
+    memset(emsg, 0, sizeof(ExecMsg));
+    if(msg->type == MSG_EXEC_BLOCK)
+    {
+        uint64_t block_id;
+        BlockMsg *block;
+        if(get_delta(&p, end, &(reader->last_exec_id)) != 0)
+            return -1;
+        emsg->exec_id = reader->last_exec_id;
+        if(get_varint(&p, end, &(emsg->thread_id)) != 0 || get_varint(&p, end, &block_id) != 0 ||
+           p != end || block_id >= reader->block_count)
+            return -1;
+        block = reader->blocks[block_id];
+        emsg->number = block->number;
+        emsg->length = block->length;
+        // The addresses are copied as the converters modify them
+        reserve_addresses(reader, block->number);
+        memcpy(reader->addresses, block->addresses, block->number*8);
+        emsg->lengths = block->lengths;
+    }
+    else if(reader->protocol >= 2)
+    {
+        if(get_delta(&p, end, &(reader->last_exec_id)) != 0)
+            return -1;
+        emsg->exec_id = reader->last_exec_id;
+        if(get_varint(&p, end, &(emsg->thread_id)) != 0 || get_block(reader, p, end, emsg) != 0)
+            return -1;
+    }
+    else
+    {
+        if(size < 32)
+            return -1;
+        emsg->exec_id = get_u64(p);
+        emsg->thread_id = get_u64(p + 8);
+        emsg->number = get_u64(p + 16);
+        emsg->length = get_u64(p + 24);
+        if(emsg->number > size || emsg->length > size || 32 + emsg->number*9 + emsg->length != size)
+            return -1;
+        // Addresses are not aligned in the trace
+        reserve_addresses(reader, emsg->number);
+        memcpy(reader->addresses, p + 32, emsg->number*8);
+        emsg->lengths = (uint8_t*) p + 32 + emsg->number*8;
+    }
+    emsg->addresses = reader->addresses;
+    emsg->code = emsg->lengths + emsg->number;
+    return 0;
+}
+
+// Check a protocol 4 MemoryRangeMsg and keep its accesses in the reader
+static int start_range(TraceReader *reader, const Msg *msg)
+{
+    size_t size = msg->length - reader->header_size;
+    const uint8_t *p = msg->data, *end = msg->data + size;
+    uint64_t i, number, length = 0;
+    if(get_delta(&p, end, &(reader->last_exec_id)) != 0 || p == end)
+        return -1;
+    reader->range_exec_id = reader->last_exec_id;
+    reader->range_mode = *p++;
+    if(get_delta(&p, end, &(reader->last_mem_address)) != 0 ||
+       get_varint(&p, end, &number) != 0 || number == 0 || number > size)
+        return -1;
+    reader->range_address = reader->last_mem_address;
+    reader->range_pieces = p;
+    for(i = 0; i < number; i++)
+    {
+        uint64_t delta, piece_length;
+        if(get_varint(&p, end, &delta) != 0 || get_varint(&p, end, &piece_length) != 0 ||
+           piece_length > size)
+            return -1;
+        length += piece_length;
+    }
+    if(length != (uint64_t)(end - p))
+        return -1;
+    reader->range_pieces_end = p;
+    reader->range_data = (uint8_t*) p;
+    reader->range_left = number;
+    return 0;
+}
+
+int trace_read_memory(TraceReader *reader, const Msg *msg, MemoryMsg *mmsg)
+{
+    size_t size = msg->length - reader->header_size;
+    const uint8_t *p = msg->data, *end = msg->data + size;
+    memset(mmsg, 0, sizeof(MemoryMsg));
+    if(reader->range_piece)
+    {
+        // Checked by start_range()
+        get_delta(&(reader->range_pieces), reader->range_pieces_end, &(reader->last_ins_address));
+        get_varint(&(reader->range_pieces), reader->range_pieces_end, &(mmsg->length));
+        mmsg->exec_id = reader->range_exec_id;
+        mmsg->ins_address = reader->last_ins_address;
+        mmsg->mode = reader->range_mode;
+        mmsg->start_address = reader->range_address;
+        mmsg->data = reader->range_data;
+        reader->range_address += mmsg->length;
+        reader->range_data += mmsg->length;
+        return 0;
+    }
+    if(reader->protocol >= 2)
+    {
+        if(get_delta(&p, end, &(reader->last_exec_id)) != 0 ||
+           get_delta(&p, end, &(reader->last_ins_address)) != 0 || p == end)
+            return -1;
+        mmsg->exec_id = reader->last_exec_id;
+        mmsg->ins_address = reader->last_ins_address;
+        mmsg->mode = *p++;
+        if(get_delta(&p, end, &(reader->last_mem_address)) != 0 ||
+           get_varint(&p, end, &(mmsg->length)) != 0)
+            return -1;
+        mmsg->start_address = reader->last_mem_address;
+    }
+    else
+    {
+        if(size < 33)
+            return -1;
+        mmsg->exec_id = get_u64(p);
+        mmsg->ins_address = get_u64(p + 8);
+        mmsg->mode = p[16];
+        mmsg->start_address = get_u64(p + 17);
+        mmsg->length = get_u64(p + 25);
+        p += 33;
+    }
+    if(mmsg->length != (uint64_t)(end - p))
+        return -1;
+    mmsg->data = (uint8_t*) p;
+    return 0;
+}
+
+int trace_read_thread(TraceReader *reader, const Msg *msg, ThreadMsg *tmsg)
+{
+    size_t size = msg->length - reader->header_size;
+    const uint8_t *p = msg->data, *end = msg->data + size;
+    if(reader->protocol >= 2)
+    {
+        if(get_delta(&p, end, &(reader->last_exec_id)) != 0 ||
+           get_varint(&p, end, &(tmsg->thread_id)) != 0 || p == end)
+            return -1;
+        tmsg->exec_id = reader->last_exec_id;
+        tmsg->type = *p;
+        return 0;
+    }
+    if(size < 17)
+        return -1;
+    tmsg->exec_id = get_u64(p);
+    tmsg->thread_id = get_u64(p + 8);
+    tmsg->type = p[16];
+    return 0;
+}
+
+int trace_read_stamp(TraceReader *reader, const Msg *msg, StampMsg *smsg)
+{
+    size_t size = msg->length - reader->header_size;
+    const uint8_t *p = msg->data, *end = msg->data + size;
+    if(reader->protocol >= 2)
+    {
+        if(get_delta(&p, end, &(reader->last_exec_id)) != 0 ||
+           get_varint(&p, end, &(smsg->stamp)) != 0)
+            return -1;
+        smsg->exec_id = reader->last_exec_id;
+        return 0;
+    }
+    if(size < 16)
+        return -1;
+    smsg->exec_id = get_u64(p);
+    smsg->stamp = get_u64(p + 8);
+    return 0;
+}
@@ -0,0 +1,110 @@
+/* ===================================================================== */
+/* This file is part of TracerGrind                                      */
+/* TracerGrind is an execution tracing module for Valgrind               */
+/* Copyright (C) 2016                                                    */
+/* Original author:   Charles Hubain <me@haxelion.eu>                    */
+/* Contributors:      Phil Teuwen <phil@teuwen.org>                      */
+/*                    Joppe Bos <joppe_bos@hotmail.com>                  */
+/*                    Wil Michiels <w.p.a.j.michiels@tue.nl>             */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* any later version.                                                    */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/* ===================================================================== */
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../tracergrind/trace_protocol.h"
+#include "../tracergrind/trace_compress.h"
+
+// Size of the type and length fields in front of each protocol 1 message
+#define MSG_HEADER_SIZE 9
+
+// The trace file is mapped in memory when possible, otherwise it is read
+// in large chunks into a buffer. Compressed traces are decompressed into
+// that buffer. Messages are returned as views into the mapping or the
+// buffer: the pointers of a Msg and of the decoded messages are only valid
+// until the next call to trace_reader_next().
+typedef struct _TraceReader
+{
+    int fd;
+    int mapped;
+    // Mapped file
+    uint8_t *map;
+    uint64_t map_size;
+    uint64_t released;
+    // Read-ahead buffer
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+    int eof;
+    // Compressed trace
+    int compressed;
+    uint8_t *block;
+    uint8_t *raw_block;
+    size_t raw_block_size;
+    size_t raw_block_position;
+    // Offset of the next message, in the map or the buffer
+    uint64_t position;
+    // Offsets of the current and next messages in the file
+    uint64_t offset;
+    uint64_t next_offset;
+    // Aligned copy of the addresses of the last ExecMsg
+    uint64_t *addresses;
+    uint64_t max_addresses;
+    // Encoding of the messages, see trace_protocol.h
+    int protocol;
+    int header_size;
+    uint64_t last_exec_id;
+    uint64_t last_block_address;
+    uint64_t last_ins_address;
+    uint64_t last_mem_address;
+    // Blocks defined by the BlockMsg of protocol 3, indexed by block_id
+    BlockMsg **blocks;
+    uint64_t block_count;
+    uint64_t max_blocks;
+    // Accesses of the last MemoryRangeMsg of protocol 4 not returned yet
+    int range_piece;
+    uint64_t range_left;
+    const uint8_t *range_pieces;
+    const uint8_t *range_pieces_end;
+    uint8_t *range_data;
+    uint64_t range_exec_id;
+    uint64_t range_address;
+    uint8_t range_mode;
+} TraceReader;
+
+int trace_reader_open(TraceReader *reader, const char *filename);
+void trace_reader_close(TraceReader *reader);
+
+// Return 1 if a message was read, 0 at the end of the trace and -1 if
+// the trace is truncated. The BlockMsg of protocol 3 are consumed by the
+// reader, their executions are returned as MSG_EXEC_BLOCK messages. Each
+// access of a MemoryRangeMsg of protocol 4 is returned as a MSG_MEMORY
+// message.
+int trace_reader_next(TraceReader *reader, Msg *msg);
+
+// Decode a message returned by trace_reader_next(), return -1 if its
+// length does not match its content. Protocol 2 fields are relative to the
+// previous messages, every message has to be decoded in order.
+// trace_read_exec() decodes both MSG_EXEC and MSG_EXEC_BLOCK messages.
+// trace_read_memory() has to be called for every MSG_MEMORY message.
+int trace_read_info(TraceReader *reader, const Msg *msg, InfoMsg *imsg);
+int trace_read_lib(TraceReader *reader, const Msg *msg, LibMsg *lmsg);
+int trace_read_exec(TraceReader *reader, const Msg *msg, ExecMsg *emsg);
+int trace_read_memory(TraceReader *reader, const Msg *msg, MemoryMsg *mmsg);
+int trace_read_thread(TraceReader *reader, const Msg *msg, ThreadMsg *tmsg);
+int trace_read_stamp(TraceReader *reader, const Msg *msg, StampMsg *smsg);
+
+#endif // TRACE_READER_H
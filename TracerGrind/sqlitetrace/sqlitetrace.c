@@ -27,89 +27,455 @@
 #include <stdio.h>
 #include <capstone/capstone.h>
 #include <sqlite3.h>
-#include "../tracergrind/trace_protocol.h"
+#include "../common/trace_reader.h"
+#include "../common/disasm_cache.h"
 
-#define BUFFER_SIZE 2048
+// Version 1 had no static_ins table, ip/dis/op were in each ins row
+// Version 2 stored addresses, opcodes and memory data as hex TEXT
+// Version 3 had no bbl.stamp, the blocks of the threads could not be ordered
+#define SCHEMA_VERSION "4"
+#define STATIC_INS_MAX_SIZE 32
+// Stay under the default SQLITE_MAX_VARIABLE_NUMBER of older sqlite versions
+#define BATCH_MAX_VARIABLES 999
 
 static const char *SETUP_QUERY = 
 "CREATE TABLE IF NOT EXISTS info (key TEXT PRIMARY KEY, value TEXT);\n"
-"CREATE TABLE IF NOT EXISTS lib (name TEXT, base TEXT, end TEXT);\n"
-"CREATE TABLE IF NOT EXISTS bbl (addr TEXT, addr_end TEXT, size INTEGER, thread_id INTEGER);\n"
-"CREATE TABLE IF NOT EXISTS ins (bbl_id INTEGER, ip TEXT, dis TEXT, op TEXT);\n"
-"CREATE TABLE IF NOT EXISTS mem (ins_id INTEGER, ip TEXT, type TEXT, addr TEXT, addr_end TEXT, size INTEGER, data TEXT, value TEXT);\n"
+"CREATE TABLE IF NOT EXISTS lib (name TEXT, base INTEGER, end INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS bbl (addr INTEGER, addr_end INTEGER, size INTEGER, thread_id INTEGER, stamp INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS static_ins (id INTEGER PRIMARY KEY, ip INTEGER, dis TEXT, op BLOB);\n"
+"CREATE TABLE IF NOT EXISTS ins (bbl_id INTEGER, static_ins_id INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS mem (ins_id INTEGER, ip INTEGER, type TEXT, addr INTEGER, addr_end INTEGER, size INTEGER, data BLOB, value INTEGER);\n"
 "CREATE TABLE IF NOT EXISTS thread (thread_id INTEGER, start_bbl_id INTEGER, exit_bbl_id INTEGER);\n";
 
-int fget_cstr(char *buffer, int size, FILE *file)
+// Indexes are built once the whole trace is loaded, it is faster than
+// updating them on each insert
+static const char *INDEX_QUERY =
+"CREATE INDEX IF NOT EXISTS mem_ins_id ON mem (ins_id);\n"
+"CREATE INDEX IF NOT EXISTS ins_bbl_id ON ins (bbl_id);\n"
+"CREATE INDEX IF NOT EXISTS mem_addr ON mem (addr);\n"
+"CREATE INDEX IF NOT EXISTS bbl_stamp ON bbl (stamp);\n";
+// A database we append to already has these keys
+static const char *SCHEMA_INFO_QUERY =
+"INSERT OR REPLACE INTO info (key, value) VALUES ('SCHEMA_VERSION', '" SCHEMA_VERSION "');\n";
+static const char *INDEX_INFO_QUERY =
+"INSERT OR REPLACE INTO info (key, value) VALUES ('INDEXES', 'mem.ins_id,ins.bbl_id,mem.addr,bbl.stamp');\n";
+
+// The database can be generated again from the trace, no need for durability
+static const char *FAST_QUERY =
+"PRAGMA page_size=65536;\n"
+"PRAGMA cache_size=-262144;\n"
+"PRAGMA journal_mode=OFF;\n"
+"PRAGMA synchronous=OFF;\n"
+"PRAGMA locking_mode=EXCLUSIVE;\n"
+"PRAGMA temp_store=MEMORY;\n";
+
+// ---- Batched inserts ----
+// Rows are gathered in memory and written with one multi-row INSERT.
+// Rowids are assigned here so that ids are known without asking sqlite.
+
+typedef struct _BatchValue
+{
+    int type;
+    sqlite3_int64 integer;
+    size_t offset;
+    int length;
+} BatchValue;
+
+typedef struct _Batch
+{
+    sqlite3 *db;
+    const char *table;
+    const char *columns;
+    int column_count;
+    int max_rows;
+    int rows;
+    sqlite3_int64 next_rowid;
+    BatchValue *values;
+    uint8_t *data;
+    size_t data_size;
+    size_t data_capacity;
+    sqlite3_stmt *insert;
+} Batch;
+
+static sqlite3_stmt* batch_prepare(Batch *batch, int rows)
 {
+    sqlite3_stmt *stmt;
+    size_t size = strlen(batch->table) + strlen(batch->columns) + 32 + rows*(2*batch->column_count+3);
+    char *query = (char*) malloc(size);
+    char *p = query;
+    int i, j;
+    p += sprintf(p, "INSERT INTO %s (%s) VALUES ", batch->table, batch->columns);
+    for(i = 0; i < rows; i++)
+    {
+        *p++ = i ? ',' : ' ';
+        *p++ = '(';
+        for(j = 0; j < batch->column_count; j++)
+        {
+            if(j)
+                *p++ = ',';
+            *p++ = '?';
+        }
+        *p++ = ')';
+    }
+    *p++ = ';';
+    *p = '\0';
+    if(sqlite3_prepare_v2(batch->db, query, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        printf("Could not prepare insert in %s: %s\n", batch->table, sqlite3_errmsg(batch->db));
+        exit(3);
+    }
+    free(query);
+    return stmt;
+}
+
+// columns lists the rowid column first, it is filled by batch_row()
+void batch_init(Batch *batch, sqlite3 *db, const char *table, const char *columns, int column_count)
+{
+    sqlite3_stmt *query;
+    char buffer[128];
+
+    batch->db = db;
+    batch->table = table;
+    batch->columns = columns;
+    batch->column_count = column_count;
+    batch->max_rows = BATCH_MAX_VARIABLES / column_count;
+    batch->rows = 0;
+    batch->values = (BatchValue*) malloc(sizeof(BatchValue)*batch->max_rows*column_count);
+    batch->data_capacity = 65536;
+    batch->data_size = 0;
+    batch->data = (uint8_t*) malloc(batch->data_capacity);
+    batch->insert = batch_prepare(batch, batch->max_rows);
+    // The database may already contain a trace
+    snprintf(buffer, sizeof(buffer), "SELECT ifnull(max(rowid), 0) + 1 FROM %s;", table);
+    sqlite3_prepare_v2(db, buffer, -1, &query, NULL);
+    if(sqlite3_step(query) == SQLITE_ROW)
+        batch->next_rowid = sqlite3_column_int64(query, 0);
+    else
+        batch->next_rowid = 1;
+    sqlite3_finalize(query);
+}
+
+void batch_flush(Batch *batch)
+{
+    sqlite3_stmt *stmt;
     int i;
-    char c;
-    for(i = 0; i < size-1; i++)
+    if(batch->rows == 0)
+        return;
+    if(batch->rows == batch->max_rows)
+        stmt = batch->insert;
+    else
+        stmt = batch_prepare(batch, batch->rows);
+    for(i = 0; i < batch->rows*batch->column_count; i++)
+    {
+        BatchValue *value = &(batch->values[i]);
+        switch(value->type)
+        {
+            case SQLITE_INTEGER:
+                sqlite3_bind_int64(stmt, i+1, value->integer);
+                break;
+            case SQLITE_TEXT:
+                sqlite3_bind_text(stmt, i+1, (const char*) &(batch->data[value->offset]), value->length, SQLITE_STATIC);
+                break;
+            case SQLITE_BLOB:
+                sqlite3_bind_blob(stmt, i+1, &(batch->data[value->offset]), value->length, SQLITE_STATIC);
+                break;
+            default:
+                sqlite3_bind_null(stmt, i+1);
+                break;
+        }
+    }
+    if(sqlite3_step(stmt) != SQLITE_DONE)
+        printf("%s error: %s\n", batch->table, sqlite3_errmsg(batch->db));
+    if(stmt == batch->insert)
+        sqlite3_reset(stmt);
+    else
+        sqlite3_finalize(stmt);
+    batch->rows = 0;
+    batch->data_size = 0;
+}
+
+void batch_finalize(Batch *batch)
+{
+    batch_flush(batch);
+    sqlite3_finalize(batch->insert);
+    free(batch->values);
+    free(batch->data);
+}
+
+// Start a new row and return its rowid
+sqlite3_int64 batch_row(Batch *batch)
+{
+    BatchValue *value;
+    int i;
+    if(batch->rows == batch->max_rows)
+        batch_flush(batch);
+    value = &(batch->values[batch->rows*batch->column_count]);
+    for(i = 0; i < batch->column_count; i++)
+        value[i].type = SQLITE_NULL;
+    value[0].type = SQLITE_INTEGER;
+    value[0].integer = batch->next_rowid;
+    batch->rows++;
+    return batch->next_rowid++;
+}
+
+void batch_int64(Batch *batch, int column, sqlite3_int64 integer)
+{
+    BatchValue *value = &(batch->values[(batch->rows-1)*batch->column_count + column]);
+    value->type = SQLITE_INTEGER;
+    value->integer = integer;
+}
+
+static void batch_bytes(Batch *batch, int column, int type, const void *data, int length)
+{
+    BatchValue *value = &(batch->values[(batch->rows-1)*batch->column_count + column]);
+    if(batch->data_size + length > batch->data_capacity)
+    {
+        while(batch->data_size + length > batch->data_capacity)
+            batch->data_capacity *= 2;
+        batch->data = (uint8_t*) realloc(batch->data, batch->data_capacity);
+    }
+    memcpy(&(batch->data[batch->data_size]), data, length);
+    value->type = type;
+    value->offset = batch->data_size;
+    value->length = length;
+    batch->data_size += length;
+}
+
+void batch_text(Batch *batch, int column, const char *text)
+{
+    batch_bytes(batch, column, SQLITE_TEXT, text, strlen(text));
+}
+
+void batch_blob(Batch *batch, int column, const void *data, int length)
+{
+    batch_bytes(batch, column, SQLITE_BLOB, data, length);
+}
+
+// ---- Memory events lookup ----
+// Memory events of an ExecMsg are sorted by instruction address, keeping
+// their trace order for a same instruction, so that each instruction finds
+// its reads and writes with a binary search.
+
+static const MemoryMsg *sorted_memory_events = NULL;
+
+// Return the SCHEMA_VERSION of the database we append to, 0 for a new
+// database and 1 for the ones written before the info key
+static int read_schema_version(sqlite3 *db)
+{
+    sqlite3_stmt *query;
+    int version = 0;
+    if(sqlite3_prepare_v2(db, "SELECT value FROM info WHERE key = 'SCHEMA_VERSION';", -1, &query, NULL) == SQLITE_OK)
+    {
+        if(sqlite3_step(query) == SQLITE_ROW)
+            version = sqlite3_column_int(query, 0);
+        sqlite3_finalize(query);
+    }
+    if(version == 0 &&
+       sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'ins';", -1, &query, NULL) == SQLITE_OK)
     {
-        c = (char)fgetc(file);
-        if(c == '\0')
-            break;
-        buffer[i] = c;
+        if(sqlite3_step(query) == SQLITE_ROW)
+            version = 1;
+        sqlite3_finalize(query);
     }
-    buffer[i] = '\0';
-    return i;
+    return version;
+}
+
+static int memory_event_cmp(const void *a, const void *b)
+{
+    int ia = *(const int*)a, ib = *(const int*)b;
+    uint64_t aa = sorted_memory_events[ia].ins_address, ab = sorted_memory_events[ib].ins_address;
+    if(aa != ab)
+        return aa < ab ? -1 : 1;
+    return ia - ib;
+}
+
+void sort_memory_events(const MemoryMsg *memory_events, int *order, int number)
+{
+    int i;
+    for(i = 0; i < number; i++)
+        order[i] = i;
+    sorted_memory_events = memory_events;
+    qsort(order, number, sizeof(int), memory_event_cmp);
+}
+
+// Return the position in order of the first memory event of ins_address
+int find_memory_events(const MemoryMsg *memory_events, const int *order, int number, uint64_t ins_address)
+{
+    int low = 0, high = number;
+    while(low < high)
+    {
+        int mid = low + (high-low)/2;
+        if(memory_events[order[mid]].ins_address < ins_address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// ---- Static instructions ----
+// Each unique instruction is written once in static_ins, ins rows refer to it
+typedef struct _StaticIns
+{
+    uint64_t address;
+    cs_mode mode;
+    uint16_t size;
+    uint8_t bytes[STATIC_INS_MAX_SIZE];
+    sqlite3_int64 id;
+} StaticIns;
+
+static StaticIns *static_ins_table = NULL;
+static size_t static_ins_capacity = 0;
+static size_t static_ins_count = 0;
+
+static size_t static_ins_hash(uint64_t address, cs_mode mode, const uint8_t *bytes, uint16_t size)
+{
+    uint64_t h = address ^ ((uint64_t)mode << 56);
+    uint16_t i;
+    for(i = 0; i < size; i++)
+        h = (h ^ bytes[i]) * 0x100000001b3ULL;
+    return (size_t)(h ^ (h >> 29));
+}
+
+// Return the slot of an instruction, an unused slot (id == 0) if it is not known yet
+StaticIns* static_ins_lookup(uint64_t address, cs_mode mode, const uint8_t *bytes, uint16_t size)
+{
+    size_t i, slot;
+    if(size > STATIC_INS_MAX_SIZE)
+        size = STATIC_INS_MAX_SIZE;
+    // Keep the load factor under 1/2
+    if(2*(static_ins_count+1) > static_ins_capacity)
+    {
+        StaticIns *old_table = static_ins_table;
+        size_t old_capacity = static_ins_capacity;
+        static_ins_capacity = old_capacity ? 2*old_capacity : 4096;
+        static_ins_table = (StaticIns*) calloc(static_ins_capacity, sizeof(StaticIns));
+        for(i = 0; i < old_capacity; i++)
+        {
+            if(old_table[i].id == 0)
+                continue;
+            slot = static_ins_hash(old_table[i].address, old_table[i].mode, old_table[i].bytes,
+                                   old_table[i].size) & (static_ins_capacity-1);
+            while(static_ins_table[slot].id != 0)
+                slot = (slot+1) & (static_ins_capacity-1);
+            static_ins_table[slot] = old_table[i];
+        }
+        free(old_table);
+    }
+    slot = static_ins_hash(address, mode, bytes, size) & (static_ins_capacity-1);
+    while(static_ins_table[slot].id != 0)
+    {
+        StaticIns *entry = &(static_ins_table[slot]);
+        if(entry->address == address && entry->mode == mode && entry->size == size &&
+           memcmp(entry->bytes, bytes, size) == 0)
+            return entry;
+        slot = (slot+1) & (static_ins_capacity-1);
+    }
+    static_ins_table[slot].address = address;
+    static_ins_table[slot].mode = mode;
+    static_ins_table[slot].size = size;
+    memcpy(static_ins_table[slot].bytes, bytes, size);
+    return &(static_ins_table[slot]);
 }
 
 int main(int argc, char **argv)
 {
+    int i;
     csh capstone_handle;
     cs_arch arch;
     cs_mode mode;
-    cs_insn *insn;
+    DisasmCache disasm_cache;
+    const DisasmBlock *block;
     size_t size, count;
     Msg msg;
     int max_events = 128;
-    int max_data = 1024;
+    size_t max_data = 1024;
     MemoryMsg *memory_events_buffer;
+    int *memory_events_order;
     int memory_events_idx = 0;
-    char buffer[BUFFER_SIZE];
-    FILE *trace;
+    uint8_t *memory_data;
+    size_t memory_data_size = 0;
+    TraceReader trace;
+    int status;
+    const char *trace_filename = NULL, *db_filename = NULL;
+    int fast = 0, version;
     sqlite3 *db;
     sqlite3_int64 bbl_id = 0, ins_id = 0;
-    sqlite3_stmt *info_insert, *bbl_insert, *lib_insert, *ins_insert, *mem_insert, *thread_insert, *thread_update;
+    sqlite3_stmt *info_insert, *lib_insert, *thread_insert, *thread_update;
+    Batch bbl_batch, static_ins_batch, ins_batch, mem_batch;
+    // Stamp of the next ExecMsg
+    StampMsg stamp;
+    int has_stamp = 0;
 
     memory_events_buffer = (MemoryMsg*) malloc(sizeof(MemoryMsg)*max_events);
-    if(argc < 3)
+    memory_events_order = (int*) malloc(sizeof(int)*max_events);
+    memory_data = (uint8_t*) malloc(max_data);
+    disasm_cache_init(&disasm_cache);
+    for(i = 1; i < argc; i++)
     {
-        printf("Usage: sqlitetrace trace db\n");
+        if(strcmp(argv[i], "--fast") == 0)
+            fast = 1;
+        else if(trace_filename == NULL)
+            trace_filename = argv[i];
+        else if(db_filename == NULL)
+            db_filename = argv[i];
+    }
+    if(trace_filename == NULL || db_filename == NULL)
+    {
+        printf("Usage: sqlitetrace [--fast] trace db\n");
+        printf("  --fast  no journal nor sync, only for databases which can be generated again\n");
         return 1;
     }
-    trace = fopen(argv[1], "rb");
-    if(trace == NULL)
+    if(trace_reader_open(&trace, trace_filename) != 0)
     {
-        printf("Could not open file %s for reading\n", argv[1]);
+        printf("Could not open file %s for reading\n", trace_filename);
         return 2;
     }
-    if(sqlite3_open(argv[2], &db) != SQLITE_OK)
+    if(sqlite3_open(db_filename, &db) != SQLITE_OK)
     {
-        printf("Could not open database %s: %s\n", argv[2], sqlite3_errmsg(db));
+        printf("Could not open database %s: %s\n", db_filename, sqlite3_errmsg(db));
         return 3;
     }
+    // The tables of another version would be kept as they are
+    version = read_schema_version(db);
+    if(version != 0 && version != atoi(SCHEMA_VERSION))
+    {
+        printf("Database %s has schema version %d, cannot append to it with version %s\n", db_filename, version, SCHEMA_VERSION);
+        return 3;
+    }
+    if(fast && sqlite3_exec(db, FAST_QUERY, NULL, NULL, NULL) != SQLITE_OK)
+    {
+        printf("Could not setup fast mode: %s\n", sqlite3_errmsg(db));
+    }
     if(sqlite3_exec(db, SETUP_QUERY, NULL, NULL, NULL) != SQLITE_OK)
     {
         printf("Could not setup database: %s\n", sqlite3_errmsg(db));
     }
     sqlite3_prepare_v2(db, "INSERT INTO info (key, value) VALUES (?, ?);", -1, &info_insert, NULL);
     sqlite3_prepare_v2(db, "INSERT INTO lib (name, base, end) VALUES (?, ?, ?);", -1, &lib_insert, NULL);
-    sqlite3_prepare_v2(db, "INSERT INTO bbl (addr, addr_end, size, thread_id) VALUES (?, ?, ?, ?);", -1, &bbl_insert, NULL);
-    sqlite3_prepare_v2(db, "INSERT INTO ins (bbl_id, ip, dis, op) VALUES (?, ?, ?, ?);", -1, &ins_insert, NULL);
-    sqlite3_prepare_v2(db, "INSERT INTO mem (ins_id, ip, type, addr, addr_end, size, data, value) VALUES (?, ?, ?, ?, ?, ?, ?, ?);", -1, &mem_insert, NULL);
+    batch_init(&bbl_batch, db, "bbl", "rowid, addr, addr_end, size, thread_id, stamp", 6);
+    batch_init(&static_ins_batch, db, "static_ins", "id, ip, dis, op", 4);
+    batch_init(&ins_batch, db, "ins", "rowid, bbl_id, static_ins_id", 3);
+    batch_init(&mem_batch, db, "mem", "rowid, ins_id, ip, type, addr, addr_end, size, data, value", 9);
     sqlite3_prepare_v2(db, "INSERT INTO thread (thread_id, start_bbl_id) VALUES (?, ?);", -1, &thread_insert, NULL);
     sqlite3_prepare_v2(db, "UPDATE thread SET exit_bbl_id=? WHERE thread_id=?;", -1, &thread_update, NULL);
 
     sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
-    while(fread((void*)&(msg.type), 1, 1, trace) != 0)
+    if(sqlite3_exec(db, SCHEMA_INFO_QUERY, NULL, NULL, NULL) != SQLITE_OK)
+        printf("INFO error: %s\n", sqlite3_errmsg(db));
+    while((status = trace_reader_next(&trace, &msg)) > 0)
     {
-        fread((void*)&(msg.length), 8, 1, trace);
         if(msg.type == MSG_INFO)
         {
-            char key[128], value[BUFFER_SIZE];
-            fget_cstr(key, 128, trace);
-            fget_cstr(value, BUFFER_SIZE, trace);
+            InfoMsg imsg;
+            const char *key, *value;
+            if(trace_read_info(&trace, &msg, &imsg) != 0)
+            {
+                printf("InfoMsg has unterminated strings.\n");
+                return 4;
+            }
+            key = imsg.key;
+            value = imsg.value;
             if(strcmp(key, "ARCH") == 0)
             {
                 if(strcmp(value, "AMD64") == 0)
@@ -145,6 +511,7 @@ int main(int argc, char **argv)
                     mode = CS_MODE_MIPS32;
                 }
                 cs_open(arch, mode, &capstone_handle);
+                disasm_cache_open(&disasm_cache, capstone_handle, mode);
             }
             sqlite3_reset(info_insert);
             sqlite3_bind_text(info_insert, 1, key, -1, SQLITE_TRANSIENT);
@@ -155,43 +522,34 @@ int main(int argc, char **argv)
         else if(msg.type == MSG_LIB)
         {
             LibMsg lmsg;
-            char name[BUFFER_SIZE];
-            fread((void*)&(lmsg.base), 8, 1, trace);
-            fread((void*)&(lmsg.end), 8, 1, trace);
-            fget_cstr(name, BUFFER_SIZE, trace);
+            if(trace_read_lib(&trace, &msg, &lmsg) != 0)
+            {
+                printf("LibMsg has an invalid length.\n");
+                return 4;
+            }
             sqlite3_reset(lib_insert);
-            sqlite3_bind_text(lib_insert, 1, name, -1, SQLITE_TRANSIENT);
-            snprintf(buffer, BUFFER_SIZE, "0x%016llx", lmsg.base);
-            sqlite3_bind_text(lib_insert, 2, buffer, -1, SQLITE_TRANSIENT);
-            snprintf(buffer, BUFFER_SIZE, "0x%016llx", lmsg.end);
-            sqlite3_bind_text(lib_insert, 3, buffer, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(lib_insert, 1, lmsg.name, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(lib_insert, 2, lmsg.base);
+            sqlite3_bind_int64(lib_insert, 3, lmsg.end);
             if(sqlite3_step(lib_insert) != SQLITE_DONE)
                 printf("LIB error: %s\n", sqlite3_errmsg(db));
         }
-        else if(msg.type == MSG_EXEC)
+        else if(msg.type == MSG_EXEC || msg.type == MSG_EXEC_BLOCK)
         {
-            int i, j, k;
-            uint8_t *code, *lengths;
+            int i, j;
+            uint8_t *code;
             uint64_t* addresses;
             ExecMsg emsg;
 
-            fread((void*)&(emsg.exec_id), 8, 1, trace);
-            fread((void*)&(emsg.thread_id), 8, 1, trace);
-            fread((void*)&(emsg.number), 8, 1, trace);
-            fread((void*)&(emsg.length), 8, 1, trace);
-            if(41 + emsg.number*9 + emsg.length != msg.length)
+            if(trace_read_exec(&trace, &msg, &emsg) != 0)
             {
                 printf("Incorrect msg length for ExecMsg %d.\n", emsg.exec_id);
                 printf("msg.length: %d emsg.number: %d emsg.length: %d.\n",
                        msg.length, emsg.number, emsg.length);
                 exit(1);
             }
-            addresses = (uint64_t*) malloc(emsg.number*8);
-            lengths = (uint8_t*) malloc(emsg.number);
-            code = (uint8_t*) malloc(emsg.length);
-            fread((void*)addresses, 8, emsg.number, trace);
-            fread((void*)lengths, 1, emsg.number, trace);
-            fread((void*)code, 1, emsg.length, trace);
+            addresses = emsg.addresses;
+            code = emsg.code;
             // Because ARM has special needs
             if(arch == CS_ARCH_ARM)
             {
@@ -203,73 +561,69 @@ int main(int argc, char **argv)
                 // ARM address normalization
                 for(i = 0; i < emsg.number; i++)
                     addresses[i] &= 0xFFFFFFFFFFFFFFFE;
-                cs_option(capstone_handle, CS_OPT_MODE, mode);
             }
             // Insert BBL
-            sqlite3_reset(bbl_insert);
-            snprintf(buffer, BUFFER_SIZE, "0x%016llx", addresses[0]);
-            sqlite3_bind_text(bbl_insert, 1, buffer, -1, SQLITE_TRANSIENT);
-            snprintf(buffer, BUFFER_SIZE, "0x%016llx", addresses[0]+emsg.length-1);
-            sqlite3_bind_text(bbl_insert, 2, buffer, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_int(bbl_insert, 3, emsg.length);
-            sqlite3_bind_int64(bbl_insert, 4, emsg.thread_id);
-            if(sqlite3_step(bbl_insert) != SQLITE_DONE)
-                printf("BBL error: %s\n", sqlite3_errmsg(db));
-            bbl_id = sqlite3_last_insert_rowid(db);
-            count = cs_disasm_ex(capstone_handle, code, emsg.length, addresses[0], 0, &insn);
+            bbl_id = batch_row(&bbl_batch);
+            batch_int64(&bbl_batch, 1, addresses[0]);
+            batch_int64(&bbl_batch, 2, addresses[0]+emsg.length-1);
+            batch_int64(&bbl_batch, 3, emsg.length);
+            batch_int64(&bbl_batch, 4, emsg.thread_id);
+            // Only traces of TracerPIN have stamps
+            if(has_stamp && stamp.exec_id == emsg.exec_id)
+                batch_int64(&bbl_batch, 5, stamp.stamp);
+            has_stamp = 0;
+            block = disasm_cache_get(&disasm_cache, addresses[0], mode, code, emsg.length);
+            count = block->count;
             // Some validation to detect disassembly failure
             if(count != emsg.number)
                 printf("Disassembly failure at ExecMsg %d!\n", emsg.exec_id);
+            sort_memory_events(memory_events_buffer, memory_events_order, memory_events_idx);
             for(i = 0; i < count; i++)
             {
+                int k;
+                // Insert the static instruction the first time it is seen
+                const DisasmIns *ins = &(block->ins[i]);
+                StaticIns *static_ins = static_ins_lookup(addresses[i], mode, ins->bytes, ins->size);
+                if(static_ins->id == 0)
+                {
+                    static_ins->id = batch_row(&static_ins_batch);
+                    batch_int64(&static_ins_batch, 1, addresses[i]);
+                    batch_text(&static_ins_batch, 2, ins->text);
+                    batch_blob(&static_ins_batch, 3, ins->bytes, ins->size);
+                    static_ins_count++;
+                }
                 // Insert instruction
-                sqlite3_reset(ins_insert);
-                sqlite3_bind_int64(ins_insert, 1, bbl_id);
-                snprintf(buffer, BUFFER_SIZE, "0x%016llx", addresses[i]);
-                sqlite3_bind_text(ins_insert, 2, buffer, -1, SQLITE_TRANSIENT);
-                snprintf(buffer, BUFFER_SIZE, "%s %s", insn[i].mnemonic, insn[i].op_str);
-                sqlite3_bind_text(ins_insert, 3, buffer, -1, SQLITE_TRANSIENT);
-                for(j = 0; j < insn[i].size && j*2+1 < BUFFER_SIZE; j++)
-                    snprintf(buffer+j*2, BUFFER_SIZE, "%02hhx", insn[i].bytes[j]);
-                sqlite3_bind_text(ins_insert, 4, buffer, -1, SQLITE_TRANSIENT);
-                if(sqlite3_step(ins_insert) != SQLITE_DONE)
-                    printf("INS error: %s\n", sqlite3_errmsg(db));
-                ins_id = sqlite3_last_insert_rowid(db);
+                ins_id = batch_row(&ins_batch);
+                batch_int64(&ins_batch, 1, bbl_id);
+                batch_int64(&ins_batch, 2, static_ins->id);
                 // Find the potential corresponding read and write in the memory events buffer
-                for(j = 0; j < memory_events_idx; j++)
+                k = find_memory_events(memory_events_buffer, memory_events_order, memory_events_idx, addresses[i]);
+                for(; k < memory_events_idx && memory_events_buffer[memory_events_order[k]].ins_address == addresses[i]; k++)
                 {
-                    if(memory_events_buffer[j].ins_address == addresses[i] && 
-                       memory_events_buffer[j].mode < MODE_INVALID)
+                    j = memory_events_order[k];
+                    if(memory_events_buffer[j].mode < MODE_INVALID)
                     {
                         // Insert read or write
-                        sqlite3_reset(mem_insert);
-                        sqlite3_bind_int64(mem_insert, 1, ins_id);
-                        snprintf(buffer, BUFFER_SIZE, "0x%016llx", addresses[i]);
-                        sqlite3_bind_text(mem_insert, 2, buffer, -1, SQLITE_TRANSIENT);
+                        batch_row(&mem_batch);
+                        batch_int64(&mem_batch, 1, ins_id);
+                        batch_int64(&mem_batch, 2, addresses[i]);
                         if(memory_events_buffer[j].mode == MODE_READ)
-                            sqlite3_bind_text(mem_insert, 3, "R", -1, SQLITE_TRANSIENT);
+                            batch_text(&mem_batch, 3, "R");
                         else if(memory_events_buffer[j].mode == MODE_WRITE)
-                            sqlite3_bind_text(mem_insert, 3, "W", -1, SQLITE_TRANSIENT);
-                        snprintf(buffer, BUFFER_SIZE, "0x%016llx", memory_events_buffer[j].start_address);
-                        sqlite3_bind_text(mem_insert, 4, buffer, -1, SQLITE_TRANSIENT);
-                        snprintf(buffer, BUFFER_SIZE, "0x%016llx", memory_events_buffer[j].start_address + 
-                                 memory_events_buffer[j].length - 1);
-                        sqlite3_bind_text(mem_insert, 5, buffer, -1, SQLITE_TRANSIENT);
-                        sqlite3_bind_int(mem_insert, 6, memory_events_buffer[j].length);
-                        for(k = 0; k < memory_events_buffer[j].length && k*2+1 < BUFFER_SIZE; k++)
-                            snprintf(buffer+k*2, BUFFER_SIZE, "%02hhx", memory_events_buffer[j].data[k]);
-                        sqlite3_bind_text(mem_insert, 7, buffer, -1, SQLITE_TRANSIENT);
+                            batch_text(&mem_batch, 3, "W");
+                        batch_int64(&mem_batch, 4, memory_events_buffer[j].start_address);
+                        batch_int64(&mem_batch, 5, memory_events_buffer[j].start_address +
+                                    memory_events_buffer[j].length - 1);
+                        batch_int64(&mem_batch, 6, memory_events_buffer[j].length);
+                        batch_blob(&mem_batch, 7, memory_events_buffer[j].data, memory_events_buffer[j].length);
                         if(memory_events_buffer[j].length == 1)
-                            snprintf(buffer, BUFFER_SIZE, "0x%02hhx", *((uint8_t*)memory_events_buffer[j].data));
+                            batch_int64(&mem_batch, 8, *((uint8_t*)memory_events_buffer[j].data));
                         else if(memory_events_buffer[j].length == 2)
-                            snprintf(buffer, BUFFER_SIZE, "0x%04hx", *((uint16_t*)memory_events_buffer[j].data));
+                            batch_int64(&mem_batch, 8, *((uint16_t*)memory_events_buffer[j].data));
                         else if(memory_events_buffer[j].length == 4)
-                            snprintf(buffer, BUFFER_SIZE, "0x%08x", *((uint32_t*)memory_events_buffer[j].data));
+                            batch_int64(&mem_batch, 8, *((uint32_t*)memory_events_buffer[j].data));
                         else if(memory_events_buffer[j].length == 8)
-                            snprintf(buffer, BUFFER_SIZE, "0x%016llx", *((uint64_t*)memory_events_buffer[j].data));
-                        sqlite3_bind_text(mem_insert, 8, buffer, -1, SQLITE_TRANSIENT);
-                        if(sqlite3_step(mem_insert) != SQLITE_DONE)
-                            printf("MEM error: %s\n", sqlite3_errmsg(db));
+                            batch_int64(&mem_batch, 8, *((uint64_t*)memory_events_buffer[j].data));
                         memory_events_buffer[j].mode = MODE_INVALID;
                     }
                 }
@@ -280,48 +634,58 @@ int main(int argc, char **argv)
             {
                 if(memory_events_buffer[i].mode != MODE_INVALID)
                     j++;
-                free(memory_events_buffer[i].data);
             }
             if(j > 0)
                 // That's embarassing ...
                 printf("%d memory events leaked at EXEC_ID: %d!\n", j, emsg.exec_id);
             memory_events_idx = 0;
-            cs_free(insn, count);
-            free(addresses);
-            free(lengths);
-            free(code);
+            memory_data_size = 0;
         }
         else if(msg.type == MSG_MEMORY)
         {
-            uint8_t *data;
+            MemoryMsg *mmsg;
             if(memory_events_idx >= max_events)
             {
                 max_events *= 2;
                 printf("Increasing size of memory_events_buffer to %d.\n", max_events);
                 memory_events_buffer = (MemoryMsg*) realloc(memory_events_buffer, 
                                                             sizeof(MemoryMsg)*max_events);
+                memory_events_order = (int*) realloc(memory_events_order, sizeof(int)*max_events);
             }
-            MemoryMsg *mmsg = &(memory_events_buffer[memory_events_idx]);
-            fread((void*)&(mmsg->exec_id), 8, 1, trace);
-            fread((void*)&(mmsg->ins_address), 8, 1, trace);
-            fread((void*)&(mmsg->mode), 1, 1, trace);
-            fread((void*)&(mmsg->start_address), 8, 1, trace);
-            fread((void*)&(mmsg->length), 8, 1, trace);
-            if(mmsg->length != msg.length-42)
+            mmsg = &(memory_events_buffer[memory_events_idx]);
+            if(trace_read_memory(&trace, &msg, mmsg) != 0)
             {
                 printf("MemoryMsg %d has an invalid code length.\n", mmsg->exec_id);
                 exit(1);
             }
-            mmsg->data = (uint8_t*) malloc(mmsg->length);
-            fread((void*)mmsg->data, 1, mmsg->length, trace);
+            // The view is only valid until the next message, the data is
+            // kept until the ExecMsg it belongs to
+            if(memory_data_size + mmsg->length > max_data)
+            {
+                size_t offset = 0;
+                while(memory_data_size + mmsg->length > max_data)
+                    max_data *= 2;
+                memory_data = (uint8_t*) realloc(memory_data, max_data);
+                // The data of the previous events is stored one after the other
+                for(i = 0; i < memory_events_idx; i++)
+                {
+                    memory_events_buffer[i].data = memory_data + offset;
+                    offset += memory_events_buffer[i].length;
+                }
+            }
+            memcpy(memory_data + memory_data_size, mmsg->data, mmsg->length);
+            mmsg->data = memory_data + memory_data_size;
+            memory_data_size += mmsg->length;
             memory_events_idx++;
         }
         else if(msg.type == MSG_THREAD)
         {
             ThreadMsg tmsg;
-            fread((void*)&(tmsg.exec_id), 8, 1, trace);
-            fread((void*)&(tmsg.thread_id), 8, 1, trace);
-            fread((void*)&(tmsg.type), 1, 1, trace);
+            if(trace_read_thread(&trace, &msg, &tmsg) != 0)
+            {
+                printf("ThreadMsg has an invalid length.\n");
+                return 4;
+            }
             if(tmsg.type == THREAD_CREATE)
             {
                 sqlite3_reset(thread_insert);
@@ -341,18 +705,32 @@ int main(int argc, char **argv)
             else
                 printf("Invalid thread message type %d encountered.\n", tmsg.type);
         }
-         else
+        else if(msg.type == MSG_STAMP)
+        {
+            if(trace_read_stamp(&trace, &msg, &stamp) != 0)
+            {
+                printf("StampMsg has an invalid length.\n");
+                return 4;
+            }
+            has_stamp = 1;
+        }
+        else
         {
             printf("Invalid message of type %d encountered.\n", msg.type);
             return 4;
         }
     }
+    batch_finalize(&bbl_batch);
+    batch_finalize(&static_ins_batch);
+    batch_finalize(&ins_batch);
+    batch_finalize(&mem_batch);
+    if(sqlite3_exec(db, INDEX_QUERY, NULL, NULL, NULL) != SQLITE_OK)
+        printf("Could not create indexes: %s\n", sqlite3_errmsg(db));
+    if(sqlite3_exec(db, INDEX_INFO_QUERY, NULL, NULL, NULL) != SQLITE_OK)
+        printf("INFO error: %s\n", sqlite3_errmsg(db));
     sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
     sqlite3_finalize(info_insert);
     sqlite3_finalize(lib_insert);
-    sqlite3_finalize(bbl_insert);
-    sqlite3_finalize(ins_insert);
-    sqlite3_finalize(mem_insert);
     sqlite3_finalize(thread_insert);
     sqlite3_finalize(thread_update);
     if(sqlite3_close(db) != SQLITE_OK)
@@ -360,8 +738,15 @@ int main(int argc, char **argv)
         printf("Failed to close db (wut?): %s\n", sqlite3_errmsg(db));
         return 5;
     }
+    disasm_cache_free(&disasm_cache);
     cs_close(&capstone_handle);
-    fclose(trace);
+    trace_reader_close(&trace);
     free(memory_events_buffer);
+    free(memory_events_order);
+    free(memory_data);
+    free(static_ins_table);
+    // What was read before the truncation is still loaded
+    if(status < 0)
+        return 4;
     return 0;
 }
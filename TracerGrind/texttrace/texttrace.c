@@ -22,63 +22,55 @@
 /* ===================================================================== */
 #define _FILE_OFFSET_BITS 64 
 
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <capstone/capstone.h>
-#include "../tracergrind/trace_protocol.h"
-
-#define BUFFER_SIZE 2048
-
-int fget_cstr(char *buffer, int size, FILE *file)
-{
-    int i;
-    char c;
-    for(i = 0; i < size-1; i++)
-    {
-        c = (char)fgetc(file);
-        if(c == '\0')
-            break;
-        buffer[i] = c;
-    }
-    buffer[i] = '\0';
-    return i;
-}
+#include "../common/trace_reader.h"
+#include "../common/disasm_cache.h"
 
 int main(int argc, char **argv)
 {
     csh capstone_handle;
     cs_arch arch;
     cs_mode mode;
-    cs_insn *insn;
+    DisasmCache disasm_cache;
+    const DisasmBlock *block;
     size_t size, count;
     Msg msg;
-    FILE *trace;
+    TraceReader trace;
     FILE *texttrace;
+    int status;
     if(argc < 3)
     {
         printf("Usage: texttrace <input> <output>\n");
         return 1;
     }
-    trace = fopen(argv[1], "rb");
-    texttrace = fopen(argv[2], "w");
-    if(trace == NULL)
+    if(trace_reader_open(&trace, argv[1]) != 0)
     {
         printf("Could not open file %s for reading\n", argv[1]);
         return 2;
     }
+    texttrace = fopen(argv[2], "w");
     if(texttrace == NULL)
     {
         printf("Could not open file %s for writing\n", argv[2]);
         return 3;
     }
-    while(fread((void*)&(msg.type), 1, 1, trace) != 0)
+    disasm_cache_init(&disasm_cache);
+    while((status = trace_reader_next(&trace, &msg)) > 0)
     {
-        fread((void*)&(msg.length), 8, 1, trace);
         if(msg.type == MSG_INFO)
         {
-            char key[128], value[BUFFER_SIZE];
-            fget_cstr(key, 128, trace);
-            fget_cstr(value, BUFFER_SIZE, trace);
+            InfoMsg imsg;
+            const char *key, *value;
+            if(trace_read_info(&trace, &msg, &imsg) != 0)
+            {
+                printf("InfoMsg has unterminated strings.\n");
+                exit(1);
+            }
+            key = imsg.key;
+            value = imsg.value;
             if(strcmp(key, "ARCH") == 0)
             {
                 if(strcmp(value, "AMD64") == 0)
@@ -114,42 +106,36 @@ int main(int argc, char **argv)
                     mode = CS_MODE_MIPS32;
                 }
                 cs_open(arch, mode, &capstone_handle);
+                disasm_cache_open(&disasm_cache, capstone_handle, mode);
             }
             fprintf(texttrace, "[!] %s: %s\n", key, value);
         }
         else if(msg.type == MSG_LIB)
         {
             LibMsg lmsg;
-            char name[BUFFER_SIZE];
-            fread((void*)&(lmsg.base), 8, 1, trace);
-            fread((void*)&(lmsg.end), 8, 1, trace);
-            fget_cstr(name, BUFFER_SIZE, trace);
+            if(trace_read_lib(&trace, &msg, &lmsg) != 0)
+            {
+                printf("LibMsg has an invalid length.\n");
+                exit(1);
+            }
             fprintf(texttrace, "[L] Loaded %s from 0x%016llx to 0x%016llx\n",
-                    name, lmsg.base, lmsg.end);
+                    lmsg.name, lmsg.base, lmsg.end);
         }
-        else if(msg.type == MSG_EXEC)
+        else if(msg.type == MSG_EXEC || msg.type == MSG_EXEC_BLOCK)
         {
             int i;
-            uint8_t *code, *lengths;
+            uint8_t *code;
             uint64_t* addresses;
             ExecMsg emsg;
-            fread((void*)&(emsg.exec_id), 8, 1, trace);
-            fread((void*)&(emsg.thread_id), 8, 1, trace);
-            fread((void*)&(emsg.number), 8, 1, trace);
-            fread((void*)&(emsg.length), 8, 1, trace);
-            if(41 + emsg.number*9 + emsg.length != msg.length)
+            if(trace_read_exec(&trace, &msg, &emsg) != 0)
             {
                 printf("Incorrect msg length for ExecMsg %d.\n", emsg.exec_id);
                 printf("msg.length: %d emsg.number: %d emsg.length: %d.\n",
                        msg.length, emsg.number, emsg.length);
                 exit(1);
             }
-            addresses = (uint64_t*) malloc(emsg.number*8);
-            lengths = (uint8_t*) malloc(emsg.number);
-            code = (uint8_t*) malloc(emsg.length);
-            fread((void*)addresses, 8, emsg.number, trace);
-            fread((void*)lengths, 1, emsg.number, trace);
-            fread((void*)code, 1, emsg.length, trace);
+            addresses = emsg.addresses;
+            code = emsg.code;
             // Because ARM has special needs
             if(arch == CS_ARCH_ARM)
             {
@@ -161,38 +147,28 @@ int main(int argc, char **argv)
                 // ARM address normalization
                 for(i = 0; i < emsg.number; i++)
                     addresses[i] &= 0xFFFFFFFFFFFFFFFE;
-                cs_option(capstone_handle, CS_OPT_MODE, mode);
             }
-            count = cs_disasm_ex(capstone_handle, code, emsg.length, addresses[0], 0, &insn);
+            block = disasm_cache_get(&disasm_cache, addresses[0], mode, code, emsg.length);
+            count = block->count;
             // Some validation to detect disassembly failure
             if(count != emsg.number)
                 printf("Disassembly failure at ExecMsg %d!\n", emsg.exec_id);
             fprintf(texttrace,"[B] EXEC_ID: %lld THREAD_ID: %016llx START_ADDRESS: %016llx END_ADDRESS: %016llx\n",
                     emsg.exec_id, emsg.thread_id, addresses[0], addresses[emsg.number-1]);
             for(i = 0; i < count; i++)
-                fprintf(texttrace, "[I] %016llx: %s %s\n", insn[i].address, insn[i].mnemonic, insn[i].op_str);
-            cs_free(insn, count);
-            free(code);
-            free(addresses);
-            free(lengths);
+                fprintf(texttrace, "[I] %016llx: %s\n", block->ins[i].address, block->ins[i].text);
         }
         else if(msg.type == MSG_MEMORY)
         {
             int i;
             uint8_t *data;
             MemoryMsg mmsg;
-            fread((void*)&(mmsg.exec_id), 8, 1, trace);
-            fread((void*)&(mmsg.ins_address), 8, 1, trace);
-            fread((void*)&(mmsg.mode), 1, 1, trace);
-            fread((void*)&(mmsg.start_address), 8, 1, trace);
-            fread((void*)&(mmsg.length), 8, 1, trace);
-            if(mmsg.length != msg.length-42)
+            if(trace_read_memory(&trace, &msg, &mmsg) != 0)
             {
                 printf("MemoryMsg %d has an invalid code length.\n", mmsg.exec_id);
                 exit(1);
             }
-            data = (uint8_t*) malloc(mmsg.length);
-            fread((void*)data, 1, mmsg.length, trace);
+            data = mmsg.data;
             fprintf(texttrace, "[M] EXEC_ID: %lld INS_ADDRESS: %016llx START_ADDRESS: %016llx LENGTH: %d ",
                     mmsg.exec_id, mmsg.ins_address, mmsg.start_address, mmsg.length);
             if(mmsg.mode == MODE_READ)
@@ -202,14 +178,15 @@ int main(int argc, char **argv)
             for(i = 0; i < mmsg.length; i++)
                 fprintf(texttrace, "%02hhx", data[i]);
             fprintf(texttrace, "\n");
-            free(data);
         }
         else if(msg.type == MSG_THREAD)
         {
             ThreadMsg tmsg;
-            fread((void*)&(tmsg.exec_id), 8, 1, trace);
-            fread((void*)&(tmsg.thread_id), 8, 1, trace);
-            fread((void*)&(tmsg.type), 1, 1, trace);
+            if(trace_read_thread(&trace, &msg, &tmsg) != 0)
+            {
+                printf("ThreadMsg has an invalid length.\n");
+                exit(1);
+            }
             fprintf(texttrace, "[T] EXEC_ID: %d THREAD_ID: %016llx TYPE: ", tmsg.exec_id, tmsg.thread_id);
             if(tmsg.type == THREAD_CREATE)
                 fprintf(texttrace, "THREAD_CREATE\n");
@@ -218,14 +195,27 @@ int main(int argc, char **argv)
             else
                 printf("Invalid thread message type %d encountered.\n", tmsg.type);
         }
+        else if(msg.type == MSG_STAMP)
+        {
+            StampMsg smsg;
+            if(trace_read_stamp(&trace, &msg, &smsg) != 0)
+            {
+                printf("StampMsg has an invalid length.\n");
+                exit(1);
+            }
+            fprintf(texttrace, "[S] EXEC_ID: %lld STAMP: %lld\n", smsg.exec_id, smsg.stamp);
+        }
         else
         {
             printf("Invalid message of type %d encountered.\n", msg.type);
             exit(1);
         }
     }
+    disasm_cache_free(&disasm_cache);
     cs_close(&capstone_handle);
-    fclose(trace);
+    trace_reader_close(&trace);
     fclose(texttrace);
+    if(status < 0)
+        return 4;
     return 0;
 }
@@ -27,16 +27,19 @@
 #include "pub_tool_libcfile.h"
 #include "pub_tool_libcassert.h"
 #include "pub_tool_libcprint.h"
+#include "pub_tool_libcproc.h"
+#include "pub_tool_mallocfree.h"
 #include "pub_tool_debuginfo.h"
 #include "pub_tool_options.h"
 #include "pub_tool_machine.h"
 #include "pub_tool_xarray.h"
 #include "pub_tool_clientstate.h"
+#include "pub_tool_vkiscnums.h"
 
 #include "trace_protocol.h"
+#include "trace_compress.h"
 #include "version.h"
 
-static uint64_t thread_id = 0;
 static uint64_t exec_id = 0;
 
 #define MAX_MEMORY_EVENT 4096
@@ -45,92 +48,491 @@ static uint64_t exec_id = 0;
 #define MAX_CODE_SIZE (32 * MAX_CODE_EVENT)
 // Assume largest read/write is of 128 bytes
 #define MEM_BUFFER_SIZE (128 * MAX_MEMORY_EVENT)
-// Largest message header + appropriate storage for events and code
-#define MSG_BUFFER_SIZE (42 + 9*MAX_CODE_EVENT + MAX_CODE_SIZE)
+// Messages are written to the trace file once this buffer is full, it
+// must be larger than the largest message header + events and code
+#define OUT_BUFFER_SIZE (8*1024*1024)
 #define CODE_BUFFER_SIZE MAX_CODE_SIZE
 #define INFO_BUFFER_SIZE 32768
+#define MAX_INLINE_MEM_FILTER 8
 #define MAX_THREAD 2048
-#define MAX_FILTER 64
 
 static HChar* trace_output_filename;
 static HChar *filter_str;
-static HChar *filters_instr[MAX_FILTER];
+static HChar **filters_instr;
 static HChar *filter_mem_str;
-static HChar *filters_mem[MAX_FILTER];
+static HChar **filters_mem;
 static HChar *filter_bblock_str;
-static HChar *filters_bblock[MAX_FILTER];
+static HChar **filters_bblock;
 static Int trace_output_fd = 0;
-static Addr filter_instr_start[MAX_FILTER], filter_instr_end[MAX_FILTER];
-static Addr filter_mem_start[MAX_FILTER], filter_mem_end[MAX_FILTER];
-static Int filter_bblock_start[MAX_FILTER], filter_bblock_end[MAX_FILTER];
 static int filter_instr_number = 0;
 static int filter_mem_number = 0;
 static int filter_bblock_number = 0;
 static int trace_instr = 1;
 static int trace_mem_read = 1;
 static int trace_mem_write = 1;
+static int compress_trace = 0;
+static int protocol = 1;
 
-static int memory_events_idx = 0;
-static int memory_buffer_idx = 0;
-static uint8_t memory_buffer[MEM_BUFFER_SIZE];
-static uint8_t msg_buffer[MSG_BUFFER_SIZE];
-static MemoryMsg memory_events[MAX_MEMORY_EVENT];
-static int code_buffer_idx = 0;
-static int code_event_idx = 0;
-static uint64_t address_buffer[MAX_CODE_EVENT];
-static uint8_t length_buffer[MAX_CODE_EVENT];
-static uint8_t code_buffer[CODE_BUFFER_SIZE];
+static int out_buffer_idx = 0;
+static uint8_t out_buffer[OUT_BUFFER_SIZE];
+static uint8_t compress_buffer[TRACE_COMPRESS_HEADER_SIZE + TRACE_COMPRESS_BOUND(TRACE_COMPRESS_BLOCK_SIZE)];
+static uint32_t compress_table[TRACE_COMPRESS_HASH_SIZE];
 static uint32_t thread_counter = 0;
 static uint64_t thread_ids[MAX_THREAD];
 
+// The code and memory events of the block being executed by a thread, a
+// block stays open while other threads run unless part of it was already sent
+typedef struct _ThreadEvents
+{
+    uint64_t thread_id;
+    int code_buffer_idx;
+    int code_event_idx;
+    uint64_t address_buffer[MAX_CODE_EVENT];
+    uint8_t length_buffer[MAX_CODE_EVENT];
+    uint8_t code_buffer[CODE_BUFFER_SIZE];
+    // First code event of the segment being executed
+    int segment_event_idx;
+    int memory_events_idx;
+    int memory_buffer_idx;
+    // Memory events of the open block were already sent, its ExecMsg has to
+    // follow before another thread sends anything
+    int memory_flushed;
+    MemoryMsg memory_events[MAX_MEMORY_EVENT];
+    uint8_t memory_buffer[MEM_BUFFER_SIZE];
+} ThreadEvents;
+
+// Allocated when a thread first runs, ThreadId 0 is invalid and is used
+// for the ThreadIds above MAX_THREAD
+static ThreadEvents *thread_events[MAX_THREAD];
+// Events of the running thread
+static ThreadEvents *events = NULL;
+
+// ---- Filters ----
+
+typedef struct _FilterRange
+{
+    uint64_t start;
+    uint64_t end;
+} FilterRange;
+
+// Inclusive ranges, sorted and merged by sortFilterRanges()
+typedef struct _FilterRanges
+{
+    Int number;
+    Int capacity;
+    FilterRange *ranges;
+} FilterRanges;
+
+static FilterRanges filter_instr_ranges;
+static FilterRanges filter_mem_ranges;
+static FilterRanges filter_bblock_ranges;
+// The memory filter is checked by the instrumented code when it has at most
+// MAX_INLINE_MEM_FILTER ranges
+static Bool inline_mem_filter = False;
+
+// Split a comma separated list of filters, set *number to their number
+static HChar** splitFilters(HChar *str, int *number)
+{
+    HChar **filters, *p;
+    int n = 1;
+    for(p = str; *p != '\0'; p++)
+        if(*p == ',')
+            n++;
+    filters = VG_(malloc)("tg.filters", n*sizeof(HChar*));
+    *number = 0;
+    for(p = VG_(strtok)(str, ","); p != NULL; p = VG_(strtok)(NULL, ","))
+        filters[(*number)++] = p;
+    return filters;
+}
+
+static void addFilterRange(FilterRanges *ranges, uint64_t start, uint64_t end)
+{
+    if(ranges->number == ranges->capacity)
+    {
+        ranges->capacity = ranges->capacity ? 2*ranges->capacity : 64;
+        ranges->ranges = VG_(realloc)("tg.filters.ranges", ranges->ranges, ranges->capacity*sizeof(FilterRange));
+    }
+    ranges->ranges[ranges->number].start = start;
+    ranges->ranges[ranges->number].end = end;
+    ranges->number++;
+}
+
+static Int compareFilterRanges(const void *a, const void *b)
+{
+    const FilterRange *ra = a, *rb = b;
+    if(ra->start != rb->start)
+        return ra->start < rb->start ? -1 : 1;
+    return 0;
+}
+
+// Sort the ranges and merge the ones which overlap or touch
+static void sortFilterRanges(FilterRanges *ranges)
+{
+    Int i, n = 0;
+    if(ranges->number == 0)
+        return;
+    VG_(ssort)(ranges->ranges, ranges->number, sizeof(FilterRange), compareFilterRanges);
+    for(i = 1; i < ranges->number; i++)
+    {
+        FilterRange *last = &(ranges->ranges[n]);
+        if(ranges->ranges[i].start <= last->end || ranges->ranges[i].start - last->end == 1)
+        {
+            if(ranges->ranges[i].end > last->end)
+                last->end = ranges->ranges[i].end;
+        }
+        else
+            ranges->ranges[++n] = ranges->ranges[i];
+    }
+    ranges->number = n + 1;
+}
+
+static Bool inFilterRanges(const FilterRanges *ranges, uint64_t a)
+{
+    // Find the first range starting after a
+    Int low = 0, high = ranges->number;
+    while(low < high)
+    {
+        Int mid = low + (high - low)/2;
+        if(ranges->ranges[mid].start <= a)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low > 0 && ranges->ranges[low-1].end >= a;
+}
+
+Bool traceBblock(uint64_t i)
+{
+    return filter_bblock_number == 0 || inFilterRanges(&filter_bblock_ranges, i);
+}
+
+Bool traceMem(Addr a)
+{
+    // Accesses out of the inlined ranges do not reach the callbacks
+    return filter_mem_number == 0 || inline_mem_filter || inFilterRanges(&filter_mem_ranges, a);
+}
+
 // ---- Trace file format helper functions ----
-Bool traceBblock(Int i)
+
+static void writeOutput(UInt fd, const uint8_t *data, int length)
 {
-    Int        j;
-    Bool trace_bblock = False;
+    int written = 0;
+    while(written < length)
+    {
+        Int ret = VG_(write)(fd, (const void*)&(data[written]), length - written);
+        if(ret <= 0)
+        {
+            VG_(umsg)("Error: cannot write to trace file %s\n", trace_output_filename);
+            break;
+        }
+        written += ret;
+    }
+}
 
-    if(filter_bblock_number == 0)
+void flushOutput(UInt fd)
+{
+    if(compress_trace)
     {
-        trace_bblock = True;
+        int i, size;
+        for(i = 0; i < out_buffer_idx; i += TRACE_COMPRESS_BLOCK_SIZE)
+        {
+            size = out_buffer_idx - i;
+            if(size > TRACE_COMPRESS_BLOCK_SIZE)
+                size = TRACE_COMPRESS_BLOCK_SIZE;
+            size = trace_compress_block(&(out_buffer[i]), size, compress_buffer, compress_table);
+            writeOutput(fd, compress_buffer, size);
+        }
     }
     else
+        writeOutput(fd, out_buffer, out_buffer_idx);
+    out_buffer_idx = 0;
+}
+
+// Return where to serialize a message of length bytes in the output buffer
+static uint8_t* reserveOutput(UInt fd, uint64_t length)
+{
+    uint8_t *msg_buffer;
+    tl_assert(length <= OUT_BUFFER_SIZE);
+    if(out_buffer_idx + length > OUT_BUFFER_SIZE)
+        flushOutput(fd);
+    msg_buffer = &(out_buffer[out_buffer_idx]);
+    out_buffer_idx += length;
+    return msg_buffer;
+}
+
+// ---- Protocol 2 ----
+// See trace_protocol.h, fields are encoded relative to the previous messages
+
+// Encoding of the messages being written, PROTOCOL is sent with protocol 1
+static int msg_protocol = 1;
+static uint64_t last_exec_id = 0;
+static uint64_t last_block_address = 0;
+static uint64_t last_ins_address = 0;
+static uint64_t last_mem_address = 0;
+static uint8_t *msg2_start;
+
+// Return where to serialize the payload of a message of at most length bytes
+static uint8_t* beginMsg2(UInt fd, uint64_t length)
+{
+    msg2_start = reserveOutput(fd, MSG_HEADER_MAX_SIZE + length);
+    return &(msg2_start[MSG_HEADER_MAX_SIZE]);
+}
+
+// Write the header in front of the payload which ends at end
+static void endMsg2(uint8_t type, uint8_t *end)
+{
+    uint64_t length = end - &(msg2_start[MSG_HEADER_MAX_SIZE]);
+    int header_size;
+    msg2_start[0] = type;
+    header_size = 1 + putVarint(&(msg2_start[1]), length);
+    VG_(memmove)((void*)&(msg2_start[header_size]), (void*)&(msg2_start[MSG_HEADER_MAX_SIZE]), length);
+    out_buffer_idx = (msg2_start - out_buffer) + header_size + length;
+}
+
+static uint8_t* putExecId(uint8_t *p, uint64_t exec_id)
+{
+    p += putVarint(p, zigzagEncode(exec_id - last_exec_id));
+    last_exec_id = exec_id;
+    return p;
+}
+
+static void sendInfoMsg2(UInt fd, InfoMsg *info_msg)
+{
+    uint64_t key_length = VG_(strlen)(info_msg->key)+1;
+    uint64_t value_length = VG_(strlen)(info_msg->value)+1;
+    uint8_t *p = beginMsg2(fd, key_length + value_length);
+    VG_(strcpy)((HChar*)p, info_msg->key);
+    VG_(strcpy)((HChar*)&(p[key_length]), info_msg->value);
+    endMsg2(MSG_INFO, &(p[key_length + value_length]));
+}
+
+static void sendLibMsg2(UInt fd, LibMsg *lib_msg)
+{
+    uint64_t name_length = VG_(strlen)(lib_msg->name)+1;
+    uint8_t *p = beginMsg2(fd, 2*VARINT_MAX_SIZE + name_length);
+    p += putVarint(p, lib_msg->base);
+    p += putVarint(p, lib_msg->end);
+    VG_(strcpy)((HChar*)p, lib_msg->name);
+    endMsg2(MSG_LIB, &(p[name_length]));
+}
+
+// Write number, length, addresses, lengths and code of a block, at most
+// (3+number)*VARINT_MAX_SIZE + number + length bytes
+static uint8_t* putBlock(uint8_t *p, ExecMsg *exec_msg)
+{
+    uint64_t i;
+    p += putVarint(p, exec_msg->number);
+    p += putVarint(p, exec_msg->length);
+    if(exec_msg->number > 0)
     {
-        for(j = 0; j < filter_bblock_number; j++)
+        p += putVarint(p, zigzagEncode(exec_msg->addresses[0] - last_block_address));
+        last_block_address = exec_msg->addresses[0];
+    }
+    for(i = 1; i < exec_msg->number; i++)
+        p += putVarint(p, zigzagEncode(exec_msg->addresses[i] -
+                                       (exec_msg->addresses[i-1] + exec_msg->lengths[i-1])));
+    VG_(memcpy)((void*)p, (void*)exec_msg->lengths, exec_msg->number);
+    p += exec_msg->number;
+    VG_(memcpy)((void*)p, (void*)exec_msg->code, exec_msg->length);
+    p += exec_msg->length;
+    return p;
+}
+
+static void sendExecMsg2(UInt fd, ExecMsg *exec_msg)
+{
+    uint8_t *p = beginMsg2(fd, (5+exec_msg->number)*VARINT_MAX_SIZE + exec_msg->number + exec_msg->length);
+    p = putExecId(p, exec_msg->exec_id);
+    p += putVarint(p, exec_msg->thread_id);
+    p = putBlock(p, exec_msg);
+    endMsg2(MSG_EXEC, p);
+}
+
+static void sendMemoryMsg2(UInt fd, MemoryMsg *memory_msg)
+{
+    uint8_t *p = beginMsg2(fd, 4*VARINT_MAX_SIZE + 1 + memory_msg->length);
+    p = putExecId(p, memory_msg->exec_id);
+    p += putVarint(p, zigzagEncode(memory_msg->ins_address - last_ins_address));
+    last_ins_address = memory_msg->ins_address;
+    *p++ = memory_msg->mode;
+    p += putVarint(p, zigzagEncode(memory_msg->start_address - last_mem_address));
+    last_mem_address = memory_msg->start_address;
+    p += putVarint(p, memory_msg->length);
+    VG_(memcpy)((void*)p, memory_msg->data, memory_msg->length);
+    p += memory_msg->length;
+    endMsg2(MSG_MEMORY, p);
+}
+
+static void sendThreadMsg2(UInt fd, ThreadMsg *thread_msg)
+{
+    uint8_t *p = beginMsg2(fd, 2*VARINT_MAX_SIZE + 1);
+    p = putExecId(p, thread_msg->exec_id);
+    p += putVarint(p, thread_msg->thread_id);
+    *p++ = thread_msg->type;
+    endMsg2(MSG_THREAD, p);
+}
+
+// ---- Protocol 3 ----
+// The code of each block is sent once in a BlockMsg, a block is known by its
+// address and its code as the guest code may be modified
+
+typedef struct _BlockDef
+{
+    uint64_t hash;
+    uint64_t address;
+    uint64_t number;
+    uint64_t length;
+    uint64_t block_id;
+    // lengths followed by code
+    uint8_t *data;
+} BlockDef;
+
+static BlockDef *block_table = NULL;
+static uint64_t block_capacity = 0;
+static uint64_t block_count = 0;
+
+static uint64_t blockHash(ExecMsg *exec_msg)
+{
+    uint64_t i, h = 0xcbf29ce484222325ULL;
+    if(exec_msg->number > 0)
+        h ^= exec_msg->addresses[0];
+    for(i = 0; i < exec_msg->number; i++)
+        h = (h ^ exec_msg->lengths[i]) * 0x100000001b3ULL;
+    for(i = 0; i < exec_msg->length; i++)
+        h = (h ^ exec_msg->code[i]) * 0x100000001b3ULL;
+    return h ^ (h >> 29);
+}
+
+static Bool sameBlock(BlockDef *def, ExecMsg *exec_msg, uint64_t hash)
+{
+    return def->hash == hash && def->number == exec_msg->number && def->length == exec_msg->length &&
+           (def->number == 0 || def->address == exec_msg->addresses[0]) &&
+           VG_(memcmp)(def->data, exec_msg->lengths, def->number) == 0 &&
+           VG_(memcmp)(&(def->data[def->number]), exec_msg->code, def->length) == 0;
+}
+
+// Return the definition of the block of exec_msg, a new definition has
+// data set to NULL
+static BlockDef* lookupBlock(ExecMsg *exec_msg)
+{
+    uint64_t i, slot, hash = blockHash(exec_msg);
+    // Keep the load factor under 1/2
+    if(2*(block_count+1) > block_capacity)
+    {
+        BlockDef *old_table = block_table;
+        uint64_t old_capacity = block_capacity;
+        block_capacity = old_capacity ? 2*old_capacity : 4096;
+        block_table = VG_(calloc)("tg.blocks", block_capacity, sizeof(BlockDef));
+        for(i = 0; i < old_capacity; i++)
         {
-            if(filter_bblock_start[j] <= i && filter_bblock_end[j] >= i)
-            {
-                trace_bblock = True;
-            }
+            if(old_table[i].data == NULL)
+                continue;
+            slot = old_table[i].hash & (block_capacity-1);
+            while(block_table[slot].data != NULL)
+                slot = (slot+1) & (block_capacity-1);
+            block_table[slot] = old_table[i];
         }
+        if(old_table != NULL)
+            VG_(free)(old_table);
     }
+    slot = hash & (block_capacity-1);
+    while(block_table[slot].data != NULL)
+    {
+        if(sameBlock(&(block_table[slot]), exec_msg, hash))
+            return &(block_table[slot]);
+        slot = (slot+1) & (block_capacity-1);
+    }
+    block_table[slot].hash = hash;
+    return &(block_table[slot]);
+}
 
-    return trace_bblock;
+static void sendExecBlockMsg3(UInt fd, ExecMsg *exec_msg)
+{
+    uint8_t *p;
+    BlockDef *def = lookupBlock(exec_msg);
+    if(def->data == NULL)
+    {
+        def->address = exec_msg->number > 0 ? exec_msg->addresses[0] : 0;
+        def->number = exec_msg->number;
+        def->length = exec_msg->length;
+        def->block_id = block_count++;
+        // Never empty so that data != NULL marks a used slot
+        def->data = VG_(malloc)("tg.blocks.data", def->number + def->length + 1);
+        VG_(memcpy)((void*)def->data, (void*)exec_msg->lengths, def->number);
+        VG_(memcpy)((void*)&(def->data[def->number]), (void*)exec_msg->code, def->length);
+        p = beginMsg2(fd, (4+exec_msg->number)*VARINT_MAX_SIZE + exec_msg->number + exec_msg->length);
+        p += putVarint(p, def->block_id);
+        p = putBlock(p, exec_msg);
+        endMsg2(MSG_BLOCK, p);
+    }
+    p = beginMsg2(fd, 3*VARINT_MAX_SIZE);
+    p = putExecId(p, exec_msg->exec_id);
+    p += putVarint(p, exec_msg->thread_id);
+    p += putVarint(p, def->block_id);
+    endMsg2(MSG_EXEC_BLOCK, p);
 }
 
+// ---- Protocol 4 ----
+
+// Send number consecutive memory events whose accesses and data are
+// adjacent as one range of length bytes
+static void sendMemoryRangeMsg4(UInt fd, MemoryMsg *memory_msgs, int number, uint64_t length)
+{
+    int i;
+    uint8_t *p = beginMsg2(fd, (3+2*number)*VARINT_MAX_SIZE + 1 + length);
+    p = putExecId(p, memory_msgs[0].exec_id);
+    *p++ = memory_msgs[0].mode;
+    p += putVarint(p, zigzagEncode(memory_msgs[0].start_address - last_mem_address));
+    last_mem_address = memory_msgs[0].start_address;
+    p += putVarint(p, number);
+    for(i = 0; i < number; i++)
+    {
+        p += putVarint(p, zigzagEncode(memory_msgs[i].ins_address - last_ins_address));
+        last_ins_address = memory_msgs[i].ins_address;
+        p += putVarint(p, memory_msgs[i].length);
+    }
+    VG_(memcpy)((void*)p, memory_msgs[0].data, length);
+    p += length;
+    endMsg2(MSG_MEMORY_RANGE, p);
+}
+
+// ---- Protocol 1 ----
+
 void sendInfoMsg(UInt fd, InfoMsg *info_msg)
 {
     uint8_t type = MSG_INFO;
     uint64_t length = 9; // msg header
+    uint64_t key_length = VG_(strlen)(info_msg->key)+1;
+    uint8_t *msg_buffer;
+    if(msg_protocol >= 2)
+    {
+        sendInfoMsg2(fd, info_msg);
+        return;
+    }
+    length += key_length + VG_(strlen)(info_msg->value)+1;
+    msg_buffer = reserveOutput(fd, length);
     VG_(memcpy)((void*)msg_buffer, &type, 1);
-    VG_(strcpy)((HChar*)&(msg_buffer[9]), info_msg->key);
-    length += VG_(strlen)(info_msg->key)+1;
-    VG_(strcpy)((HChar*)&(msg_buffer[length]), info_msg->value);
-    length += VG_(strlen)(info_msg->value)+1;
     VG_(memcpy)((void*)&(msg_buffer[1]), &length, 8);
-    VG_(write)(fd, (void*)msg_buffer, length);
+    VG_(strcpy)((HChar*)&(msg_buffer[9]), info_msg->key);
+    VG_(strcpy)((HChar*)&(msg_buffer[9+key_length]), info_msg->value);
 }
 
 void sendLibMsg(UInt fd, LibMsg *lib_msg)
 {
     uint8_t type = MSG_LIB;
     uint64_t length = 25; // msg header
+    uint8_t *msg_buffer;
+    if(msg_protocol >= 2)
+    {
+        sendLibMsg2(fd, lib_msg);
+        return;
+    }
     length += VG_(strlen)(lib_msg->name)+1;
+    msg_buffer = reserveOutput(fd, length);
     VG_(memcpy)((void*)msg_buffer, &type, 1);
     VG_(memcpy)((void*)&(msg_buffer[1]), &length, 8);
     VG_(memcpy)((void*)&(msg_buffer[9]), &(lib_msg->base), 8);
     VG_(memcpy)((void*)&(msg_buffer[17]), &(lib_msg->end), 8);
     VG_(strcpy)((HChar*)&(msg_buffer[25]), lib_msg->name);
-    VG_(write)(fd, msg_buffer, length);
 }
 
 void sendExecMsg(UInt fd, ExecMsg *exec_msg)
@@ -139,7 +541,19 @@ void sendExecMsg(UInt fd, ExecMsg *exec_msg)
     {
         uint8_t type = MSG_EXEC;
         uint64_t length = 41; // msg header
+        uint8_t *msg_buffer;
+        if(msg_protocol >= 3)
+        {
+            sendExecBlockMsg3(fd, exec_msg);
+            return;
+        }
+        if(msg_protocol == 2)
+        {
+            sendExecMsg2(fd, exec_msg);
+            return;
+        }
         length += 9*exec_msg->number + exec_msg->length;
+        msg_buffer = reserveOutput(fd, length);
         VG_(memcpy)((void*)msg_buffer, &type, 1);
         VG_(memcpy)((void*)&(msg_buffer[1]), &length, 8);
         VG_(memcpy)((void*)&(msg_buffer[9]), &(exec_msg->exec_id), 8);
@@ -149,10 +563,17 @@ void sendExecMsg(UInt fd, ExecMsg *exec_msg)
         VG_(memcpy)((void*)&(msg_buffer[41]), (void*)exec_msg->addresses, 8*exec_msg->number);
         VG_(memcpy)((void*)&(msg_buffer[41+8*exec_msg->number]), (void*)exec_msg->lengths, exec_msg->number);
         VG_(memcpy)((void*)&(msg_buffer[41+9*exec_msg->number]), (void*)exec_msg->code, exec_msg->length);
-        VG_(write)(fd, msg_buffer, length);
     }
 }
 
+static void sendMemoryRangeMsg(UInt fd, MemoryMsg *memory_msgs, int number, uint64_t length)
+{
+    if(((trace_mem_read && (memory_msgs[0].mode == MODE_READ)) ||
+        (trace_mem_write && (memory_msgs[0].mode == MODE_WRITE))) &&
+       traceBblock(memory_msgs[0].exec_id))
+        sendMemoryRangeMsg4(fd, memory_msgs, number, length);
+}
+
 void sendMemoryMsg(UInt fd, MemoryMsg *memory_msg)
 {
     if ((trace_mem_read && (memory_msg->mode == MODE_READ)) || (trace_mem_write && (memory_msg->mode == MODE_WRITE)))
@@ -161,7 +582,14 @@ void sendMemoryMsg(UInt fd, MemoryMsg *memory_msg)
         {
             uint8_t type = MSG_MEMORY;
             uint64_t length = 42; // msg header
+            uint8_t *msg_buffer;
+            if(msg_protocol >= 2)
+            {
+                sendMemoryMsg2(fd, memory_msg);
+                return;
+            }
             length += memory_msg->length;
+            msg_buffer = reserveOutput(fd, length);
             VG_(memcpy)((void*)msg_buffer, &type, 1);
             VG_(memcpy)((void*)&(msg_buffer[1]), &length, 8);
             VG_(memcpy)((void*)&(msg_buffer[9]), &(memory_msg->exec_id), 8);
@@ -170,7 +598,6 @@ void sendMemoryMsg(UInt fd, MemoryMsg *memory_msg)
             VG_(memcpy)((void*)&(msg_buffer[26]), &(memory_msg->start_address), 8);
             VG_(memcpy)((void*)&(msg_buffer[34]), &(memory_msg->length), 8);
             VG_(memcpy)((void*)&(msg_buffer[42]), memory_msg->data, length-42);
-            VG_(write)(fd, msg_buffer, length);
         }
     }
 }
@@ -179,57 +606,163 @@ void sendThreadMsg(UInt fd, ThreadMsg *thread_msg)
 {
     uint8_t type = MSG_THREAD;
     uint64_t length = 26; // msg header
+    uint8_t *msg_buffer;
+    if(msg_protocol >= 2)
+    {
+        sendThreadMsg2(fd, thread_msg);
+        return;
+    }
+    msg_buffer = reserveOutput(fd, length);
     VG_(memcpy)((void*)msg_buffer, &type, 1);
     VG_(memcpy)((void*)&(msg_buffer[1]), &length, 8);
     VG_(memcpy)((void*)&(msg_buffer[9]), &(thread_msg->exec_id), 8);
     VG_(memcpy)((void*)&(msg_buffer[17]), &(thread_msg->thread_id), 8);
     VG_(memcpy)((void*)&(msg_buffer[25]), &(thread_msg->type), 1);
-    VG_(write)(fd, msg_buffer, length);
 }
 
 
 // ---- Instrumentation callbacks ----
 
-static void flushMemoryEvents()
+// Memory events are sent before the ExecMsg of their block, the converters
+// attach them to the next ExecMsg
+static void flushMemoryEvents(ThreadEvents *ev)
 {
-    int i;
-    for(i = 0; i < memory_events_idx; i++)
-        sendMemoryMsg(trace_output_fd, &(memory_events[i]));
-    memory_events_idx = 0;
-    memory_buffer_idx = 0;
+    int i, j;
+    for(i = 0; i < ev->memory_events_idx; i = j)
+    {
+        MemoryMsg *msg = &(ev->memory_events[i]);
+        uint64_t length = msg->length;
+        j = i + 1;
+        // Coalesce the accesses which continue the previous ones
+        if(msg_protocol >= 4)
+            while(j < ev->memory_events_idx && ev->memory_events[j].mode == msg->mode &&
+                  ev->memory_events[j].start_address == msg->start_address + length &&
+                  ev->memory_events[j].data == msg->data + length)
+            {
+                ev->memory_events[j].exec_id = exec_id;
+                length += ev->memory_events[j].length;
+                j++;
+            }
+        msg->exec_id = exec_id;
+        if(j - i > 1)
+            sendMemoryRangeMsg(trace_output_fd, msg, j - i, length);
+        else
+            sendMemoryMsg(trace_output_fd, msg);
+    }
+    ev->memory_events_idx = 0;
+    ev->memory_buffer_idx = 0;
 }
 
-static void flushCodeEvents()
+static void flushCodeEvents(ThreadEvents *ev)
 {
-    flushMemoryEvents();
     ExecMsg msg;
+    if(ev->code_event_idx == 0 && ev->memory_events_idx == 0)
+        return;
+    flushMemoryEvents(ev);
     msg.exec_id = exec_id;
-    msg.thread_id = thread_id;
-    msg.number = code_event_idx;
-    msg.length = code_buffer_idx;
-    msg.addresses = address_buffer;
-    msg.lengths = length_buffer;
-    msg.code = code_buffer;
+    msg.thread_id = ev->thread_id;
+    msg.number = ev->code_event_idx;
+    msg.length = ev->code_buffer_idx;
+    msg.addresses = ev->address_buffer;
+    msg.lengths = ev->length_buffer;
+    msg.code = ev->code_buffer;
     sendExecMsg(trace_output_fd, &msg);
     exec_id++;
-    code_buffer_idx = 0;
-    code_event_idx = 0;
+    ev->code_buffer_idx = 0;
+    ev->code_event_idx = 0;
+    ev->segment_event_idx = 0;
+    ev->memory_flushed = 0;
 }
 
-static VG_REGPARM(3) void instructionCallback(Addr addr, UChar delta, SizeT length)
+// Only the running thread can have sent part of its block
+static void flushEarlyMemoryBlock()
 {
-    if(code_event_idx >= MAX_CODE_EVENT ||
-       code_buffer_idx + length >= CODE_BUFFER_SIZE ||
-       (code_event_idx > 0 &&
-       address_buffer[code_event_idx-1]+length_buffer[code_event_idx-1] != addr+delta))
-        flushCodeEvents();
-    address_buffer[code_event_idx] = addr+delta;
-    length_buffer[code_event_idx] = length;
-    VG_(memcpy)((void*)&(code_buffer[code_buffer_idx]),(void*)addr, length);
-    code_event_idx++;
-    code_buffer_idx += length;
+    if(events != NULL && events->memory_flushed)
+        flushCodeEvents(events);
 }
 
+static void flushAllEvents()
+{
+    int i;
+    flushEarlyMemoryBlock();
+    for(i = 0; i < MAX_THREAD; i++)
+        if(thread_events[i] != NULL)
+            flushCodeEvents(thread_events[i]);
+}
+
+// Instructions of a superblock which are executed together, up to a side
+// exit, built when the superblock is translated
+typedef struct _CodeDesc
+{
+    UInt number;
+    UInt length;
+    uint64_t *addresses;
+    uint8_t *lengths;
+    uint8_t *code;
+} CodeDesc;
+
+static VG_REGPARM(1) void codeCallback(CodeDesc *desc)
+{
+    ThreadEvents *ev = events;
+    if(ev->code_event_idx + desc->number > MAX_CODE_EVENT ||
+       ev->code_buffer_idx + desc->length >= CODE_BUFFER_SIZE ||
+       (ev->code_event_idx > 0 &&
+       ev->address_buffer[ev->code_event_idx-1]+ev->length_buffer[ev->code_event_idx-1] != desc->addresses[0]))
+        flushCodeEvents(ev);
+    ev->segment_event_idx = ev->code_event_idx;
+    VG_(memcpy)((void*)&(ev->address_buffer[ev->code_event_idx]), (void*)desc->addresses, desc->number*sizeof(uint64_t));
+    VG_(memcpy)((void*)&(ev->length_buffer[ev->code_event_idx]), (void*)desc->lengths, desc->number);
+    VG_(memcpy)((void*)&(ev->code_buffer[ev->code_buffer_idx]), (void*)desc->code, desc->length);
+    ev->code_event_idx += desc->number;
+    ev->code_buffer_idx += desc->length;
+}
+
+// The whole segment is recorded before it runs, a synchronous signal stops
+// it at the faulting instruction which is kept like the instructions before it
+static void preDeliverSignalCallback(ThreadId tid, Int sigNo, Bool alt_stack)
+{
+    ThreadEvents *ev = thread_events[tid < MAX_THREAD ? tid : 0];
+    Addr ip;
+    int i, j;
+    if(ev == NULL || (sigNo != VKI_SIGSEGV && sigNo != VKI_SIGBUS &&
+                      sigNo != VKI_SIGFPE && sigNo != VKI_SIGILL))
+        return;
+    ip = VG_(get_IP)(tid);
+    for(i = ev->segment_event_idx; i < ev->code_event_idx; i++)
+    {
+        if(ev->address_buffer[i] != ip)
+            continue;
+        for(j = i + 1; j < ev->code_event_idx; j++)
+            ev->code_buffer_idx -= ev->length_buffer[j];
+        ev->code_event_idx = i + 1;
+        break;
+    }
+}
+
+// The child must not write again what the parent has buffered
+static void forkCallback(ThreadId tid)
+{
+    flushAllEvents();
+    flushOutput(trace_output_fd);
+}
+
+// Valgrind replaces the process image on execve without calling tg_fini
+static void preSyscallCallback(ThreadId tid, UInt syscallno, UWord *args, UInt nArgs)
+{
+    if(syscallno == __NR_execve
+#if defined(__NR_execveat)
+       || syscallno == __NR_execveat
+#endif
+      )
+    {
+        flushAllEvents();
+        flushOutput(trace_output_fd);
+    }
+}
+
+static void postSyscallCallback(ThreadId tid, UInt syscallno, UWord *args, UInt nArgs, SysRes res)
+{
+}
 
 static void threadCreatedCallback(ThreadId tid, ThreadId child)
 {
@@ -250,6 +783,10 @@ static void threadCreatedCallback(ThreadId tid, ThreadId child)
 static void threadExitedCallback(ThreadId tid)
 {
     ThreadMsg thread_msg;
+    ThreadId slot = tid < MAX_THREAD ? tid : 0;
+    flushEarlyMemoryBlock();
+    if(thread_events[slot] != NULL)
+        flushCodeEvents(thread_events[slot]);
     thread_msg.exec_id = exec_id;
     thread_msg.type = THREAD_EXIT;
     if(tid < MAX_THREAD)
@@ -261,72 +798,74 @@ static void threadExitedCallback(ThreadId tid)
 
 static void threadStartedCallback(ThreadId tid, ULong block_dispatched)
 {
-    if(tid < MAX_THREAD)
-        thread_id = thread_ids[tid];
-    else
-        thread_id = tid;
-}
-
-Bool traceMem(Addr a)
-{
-    Int        j;
-    Bool trace_mem = False;
-
-    if(filter_mem_number == 0)
+    ThreadId slot = tid < MAX_THREAD ? tid : 0;
+    uint64_t thread_id = tid < MAX_THREAD ? thread_ids[tid] : tid;
+    if(thread_events[slot] == NULL)
     {
-        trace_mem = True;
+        thread_events[slot] = VG_(malloc)("tg.events", sizeof(ThreadEvents));
+        thread_events[slot]->thread_id = thread_id;
+        thread_events[slot]->code_buffer_idx = 0;
+        thread_events[slot]->code_event_idx = 0;
+        thread_events[slot]->segment_event_idx = 0;
+        thread_events[slot]->memory_events_idx = 0;
+        thread_events[slot]->memory_buffer_idx = 0;
+        thread_events[slot]->memory_flushed = 0;
     }
-    else
+    // The thread switched out closes its block if it sent part of it
+    if(events != thread_events[slot])
+        flushEarlyMemoryBlock();
+    events = thread_events[slot];
+    // The threads above MAX_THREAD share the same events
+    if(events->thread_id != thread_id)
     {
-        for(j = 0; j < filter_mem_number; j++)
-        {
-            if(filter_mem_start[j] <= a && filter_mem_end[j] >= a)
-            {
-                trace_mem = True;
-            }
-        }
+        flushCodeEvents(events);
+        events->thread_id = thread_id;
     }
-
-    return trace_mem;
 }
 
 static VG_REGPARM(3) void readCallback(Addr ins_addr, Addr start_addr, SizeT length)
 {
-    if(memory_events_idx>=MAX_MEMORY_EVENT ||
-       memory_buffer_idx + length >= MEM_BUFFER_SIZE)
-        flushMemoryEvents();
+    ThreadEvents *ev = events;
+    if(ev->memory_events_idx>=MAX_MEMORY_EVENT ||
+       ev->memory_buffer_idx + length >= MEM_BUFFER_SIZE)
+    {
+        flushMemoryEvents(ev);
+        ev->memory_flushed = 1;
+    }
     if (traceMem(start_addr))
     {
-        MemoryMsg *msg = &(memory_events[memory_events_idx]);
-        msg->exec_id = exec_id;
+        MemoryMsg *msg = &(ev->memory_events[ev->memory_events_idx]);
         msg->ins_address = ins_addr;
         msg->mode = MODE_READ;
         msg->start_address = start_addr;
         msg->length = length;
-        msg->data = &(memory_buffer[memory_buffer_idx]);
-        VG_(memcpy)((void*)&(memory_buffer[memory_buffer_idx]), (void*)start_addr, length);
-        memory_events_idx++;
-        memory_buffer_idx += length;
+        msg->data = &(ev->memory_buffer[ev->memory_buffer_idx]);
+        VG_(memcpy)((void*)&(ev->memory_buffer[ev->memory_buffer_idx]), (void*)start_addr, length);
+        ev->memory_events_idx++;
+        ev->memory_buffer_idx += length;
     }
 }
 
 static VG_REGPARM(3) void writeCallback(Addr ins_addr, Addr start_addr, SizeT length)
 {
-    if(memory_events_idx>=MAX_MEMORY_EVENT ||
-       memory_buffer_idx + length >= MEM_BUFFER_SIZE)
-        flushMemoryEvents();
+    ThreadEvents *ev = events;
+    if(ev->memory_events_idx>=MAX_MEMORY_EVENT ||
+       ev->memory_buffer_idx + length >= MEM_BUFFER_SIZE)
+    {
+        flushMemoryEvents(ev);
+        ev->memory_flushed = 1;
+    }
     if (traceMem(start_addr))
     {
-        MemoryMsg *msg = &(memory_events[memory_events_idx]);
-        msg->exec_id = exec_id;
+        MemoryMsg *msg = &(ev->memory_events[ev->memory_events_idx]);
         msg->ins_address = ins_addr;
         msg->mode = MODE_WRITE;
         msg->start_address = start_addr;
         msg->length = length;
-        msg->data = &(memory_buffer[memory_buffer_idx]);
-        VG_(memcpy)((void*)&(memory_buffer[memory_buffer_idx]), (void*)start_addr, length);
-        memory_events_idx++;
-        memory_buffer_idx += length;
+        msg->data = &(ev->memory_buffer[ev->memory_buffer_idx]);
+        VG_(memcpy)((void*)&(ev->memory_buffer[ev->memory_buffer_idx]), (void*)start_addr, length);
+        ev->memory_events_idx++;
+        ev->memory_buffer_idx += length;
     }
 }
 
@@ -344,11 +883,13 @@ void trackMemCallback(Addr a, SizeT len, Bool rr, Bool ww, Bool xx, ULong di_han
                ((filename != NULL && VG_(strcmp)(filters_instr[i], filename) == 0) ||
                (soname != NULL && VG_(strcmp)(filters_instr[i], soname) == 0)))
             {
-                filter_instr_start[i] = VG_(DebugInfo_get_text_avma)(di);
-                filter_instr_end[i] = filter_instr_start[i] + VG_(DebugInfo_get_text_size)(di);
+                Addr start = VG_(DebugInfo_get_text_avma)(di);
+                Addr end = start + VG_(DebugInfo_get_text_size)(di);
+                addFilterRange(&filter_instr_ranges, start, end);
+                sortFilterRanges(&filter_instr_ranges);
                 if (VG_(clo_verbosity) > 0)
                     VG_(umsg)("Filtering %s from 0x%016llx to 0x%016llx\n", filters_instr[i],
-                            (Addr64) filter_instr_start[i], (Addr64) filter_instr_end[i]);
+                            (Addr64) start, (Addr64) end);
                 filters_instr[i] = NULL;
             }
         }
@@ -368,6 +909,8 @@ static void tg_print_usage(void)
         "    --trace-instr=<yes|no>    trace instructions (default = yes, required for sqlitetrace/tracegraph)\n"
         "    --trace-memread=<yes|no>  trace memory reads (default = yes)\n"
         "    --trace-memwrite=<yes|no> trace memory writes (default = yes)\n"
+        "    --compress=<yes|no>       compress the trace (default = no)\n"
+        "    --protocol=<1|2|3|4>      trace format, 2 to 4 are smaller but need recent converters (default = 1)\n"
     );
 }
 
@@ -375,44 +918,16 @@ static Bool tg_process_cmd_line_option(const HChar* arg)
 {
     if VG_STR_CLO(arg, "--output", trace_output_filename) {}
     else if VG_STR_CLO(arg, "--filter", filter_str)
-    {
-        int i;
-        filters_instr[0] = VG_(strtok)(filter_str, ",");
-        for(i = 1; i<MAX_FILTER; i++)
-        {
-            filters_instr[i] = VG_(strtok)(NULL, ",");
-            if(filters_instr[i] == NULL)
-                break;
-        }
-        filter_instr_number = i;
-    }
+        filters_instr = splitFilters(filter_str, &filter_instr_number);
     else if VG_STR_CLO(arg, "--filter-mem", filter_mem_str)
-    {
-        int i;
-        filters_mem[0] = VG_(strtok)(filter_mem_str, ",");
-        for(i = 1; i<MAX_FILTER; i++)
-        {
-            filters_mem[i] = VG_(strtok)(NULL, ",");
-            if(filters_mem[i] == NULL)
-                break;
-        }
-        filter_mem_number = i;
-    }
+        filters_mem = splitFilters(filter_mem_str, &filter_mem_number);
     else if VG_STR_CLO(arg, "--filter-bblock", filter_bblock_str)
-    {
-        int i;
-        filters_bblock[0] = VG_(strtok)(filter_bblock_str, ",");
-        for(i = 1; i<MAX_FILTER; i++)
-        {
-            filters_bblock[i] = VG_(strtok)(NULL, ",");
-            if(filters_bblock[i] == NULL)
-                break;
-        }
-        filter_bblock_number = i;
-    }
+        filters_bblock = splitFilters(filter_bblock_str, &filter_bblock_number);
     else if VG_BOOL_CLO(arg, "--trace-instr", trace_instr) {}
     else if VG_BOOL_CLO(arg, "--trace-memread", trace_mem_read) {}
     else if VG_BOOL_CLO(arg, "--trace-memwrite", trace_mem_write) {}
+    else if VG_BOOL_CLO(arg, "--compress", compress_trace) {}
+    else if VG_BINT_CLO(arg, "--protocol", protocol, 1, PROTOCOL_VERSION_MAX) {}
     else
         return False;
     return True;
@@ -432,6 +947,7 @@ static void tg_post_clo_init(void)
     VexArchInfo vex_arch_info;
     InfoMsg msg;
     char* buffer[INFO_BUFFER_SIZE];
+    HChar protocol_str[2] = "1";
     char *start, *end;
     int i;
 
@@ -452,10 +968,23 @@ static void tg_post_clo_init(void)
         trace_output_fd = sr_Res(sres);
     }
     tl_assert(trace_output_fd);
+    if(compress_trace)
+        writeOutput(trace_output_fd, TRACE_COMPRESS_MAGIC, sizeof(TRACE_COMPRESS_MAGIC));
 
     for(i = 0; i<MAX_THREAD; i++)
+    {
         thread_ids[i] = 0;
+        thread_events[i] = NULL;
+    }
     VG_(machine_get_VexArchInfo)(&vex_arch, &vex_arch_info);
+    if(protocol > 1)
+    {
+        msg.key = STR_PROTOCOL;
+        protocol_str[0] = '0' + protocol;
+        msg.value = protocol_str;
+        sendInfoMsg(trace_output_fd, &msg);
+        msg_protocol = protocol;
+    }
     msg.key = STR_TRACERGRIND_VERSION;
     msg.value = VERSION;
     sendInfoMsg(trace_output_fd, &msg);
@@ -480,41 +1009,172 @@ static void tg_post_clo_init(void)
         end = VG_(strstr)(filters_instr[i],"-0x");
         if(start != NULL && end != NULL)
         {
-            filter_instr_start[i] = VG_(strtoull16)(&(start[2]), NULL);
-            filter_instr_end[i] = VG_(strtoull16)(&(end[3]), NULL);
+            Addr range_start = VG_(strtoull16)(&(start[2]), NULL);
+            Addr range_end = VG_(strtoull16)(&(end[3]), NULL);
+            addFilterRange(&filter_instr_ranges, range_start, range_end);
             if (VG_(clo_verbosity) > 0)
                 VG_(umsg)("Filtering instruction address range from 0x%016llx to 0x%016llx\n",
-                        (Addr64) filter_instr_start[i], (Addr64) filter_instr_end[i]);
+                        (Addr64) range_start, (Addr64) range_end);
             filters_instr[i] = NULL;
         }
     }
+    sortFilterRanges(&filter_instr_ranges);
     for(i = 0; i < filter_mem_number; i++)
     {
         start = VG_(strstr)(filters_mem[i], "0x");
         end = VG_(strstr)(filters_mem[i],"-0x");
         if(start != NULL && end != NULL)
         {
-            filter_mem_start[i] = VG_(strtoull16)(&(start[2]), NULL);
-            filter_mem_end[i] = VG_(strtoull16)(&(end[3]), NULL);
+            Addr range_start = VG_(strtoull16)(&(start[2]), NULL);
+            Addr range_end = VG_(strtoull16)(&(end[3]), NULL);
+            addFilterRange(&filter_mem_ranges, range_start, range_end);
             if (VG_(clo_verbosity) > 0)
                 VG_(umsg)("Filtering memory address range from 0x%016llx to 0x%016llx\n",
-                        (Addr64) filter_mem_start[i], (Addr64) filter_mem_end[i]);
+                        (Addr64) range_start, (Addr64) range_end);
             filters_mem[i] = NULL;
         }
     }
+    sortFilterRanges(&filter_mem_ranges);
+    inline_mem_filter = filter_mem_number > 0 && filter_mem_ranges.number <= MAX_INLINE_MEM_FILTER;
     for(i = 0; i < filter_bblock_number; i++)
     {
         end = VG_(strstr)(filters_bblock[i],"-");
         if(end != NULL)
         {
-            filter_bblock_start[i] = VG_(strtoull10)(filters_bblock[i], NULL);
-            filter_bblock_end[i] = VG_(strtoull10)(&(end[1]), NULL);
+            uint64_t range_start = VG_(strtoull10)(filters_bblock[i], NULL);
+            uint64_t range_end = VG_(strtoull10)(&(end[1]), NULL);
+            addFilterRange(&filter_bblock_ranges, range_start, range_end);
             if (VG_(clo_verbosity) > 0)
-                VG_(umsg)("Filtering basic block range from %d to %d\n",
-                          filter_bblock_start[i], filter_bblock_end[i]);
+                VG_(umsg)("Filtering basic block range from %llu to %llu\n",
+                          range_start, range_end);
             filters_bblock[i] = NULL;
         }
     }
+    sortFilterRanges(&filter_bblock_ranges);
+}
+
+// Build the descriptor of the instructions starting at the IMark sbIn->stmts[start]
+// up to the first side exit or discontinuity, set *end to the index of the
+// first statement after them. Descriptors are small and are not freed when
+// Valgrind discards a translation, which is rare.
+static CodeDesc* makeCodeDesc(IRSB* sbIn, Int start, Int *end)
+{
+    CodeDesc *desc;
+    Int i;
+    UInt number = 0, length = 0;
+    Addr64 next_addr = 0;
+    uint8_t *p;
+
+    for(i = start; i < sbIn->stmts_used; i++)
+    {
+        IRStmt* st = sbIn->stmts[i];
+        if(st->tag == Ist_IMark)
+        {
+            if(number > 0 && (next_addr != st->Ist.IMark.addr + st->Ist.IMark.delta ||
+                              number == MAX_CODE_EVENT ||
+                              length + st->Ist.IMark.len >= CODE_BUFFER_SIZE))
+                break;
+            next_addr = st->Ist.IMark.addr + st->Ist.IMark.delta + st->Ist.IMark.len;
+            number++;
+            length += st->Ist.IMark.len;
+        }
+        else if(st->tag == Ist_Exit)
+        {
+            i++;
+            break;
+        }
+    }
+    *end = i;
+    desc = VG_(malloc)("tg.codedesc", sizeof(CodeDesc) + number*(sizeof(uint64_t) + 1) + length);
+    desc->number = number;
+    desc->length = length;
+    desc->addresses = (uint64_t*) (desc + 1);
+    desc->lengths = (uint8_t*) (desc->addresses + number);
+    desc->code = desc->lengths + number;
+    p = desc->code;
+    number = 0;
+    for(i = start; i < *end; i++)
+    {
+        IRStmt* st = sbIn->stmts[i];
+        if(st->tag != Ist_IMark)
+            continue;
+        desc->addresses[number] = st->Ist.IMark.addr + st->Ist.IMark.delta;
+        desc->lengths[number] = st->Ist.IMark.len;
+        VG_(memcpy)((void*)p, (void*)(Addr)st->Ist.IMark.addr, st->Ist.IMark.len);
+        p += st->Ist.IMark.len;
+        number++;
+    }
+    return desc;
+}
+
+static IRExpr* mkWordConst(IRType tyW, uint64_t v)
+{
+    if(tyW == Ity_I32)
+        return IRExpr_Const(IRConst_U32((UInt)v));
+    return IRExpr_Const(IRConst_U64(v));
+}
+
+// Return a temporary holding the 1 bit expression e as 32 bits
+static IRExpr* mkWiden1(IRSB* sbOut, IRExpr *e)
+{
+    IRTemp t = newIRTemp(sbOut->tyenv, Ity_I32);
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(t, IRExpr_Unop(Iop_1Uto32, e)));
+    return IRExpr_RdTmp(t);
+}
+
+// Guard a memory callback with the memory filter so that the accesses out
+// of the filter do not call it. The address is the second argument of di.
+static void addMemFilterGuard(IRSB* sbOut, IRType tyW, IRDirty *di)
+{
+    IRExpr *addr = di->args[1], *any = NULL;
+    IRTemp t;
+    Int i;
+    if(!inline_mem_filter)
+        return;
+    for(i = 0; i < filter_mem_ranges.number; i++)
+    {
+        uint64_t start = filter_mem_ranges.ranges[i].start;
+        uint64_t end = filter_mem_ranges.ranges[i].end;
+        IRTemp offset, in;
+        if(tyW == Ity_I32)
+        {
+            if(start > 0xFFFFFFFFULL)
+                continue;
+            if(end > 0xFFFFFFFFULL)
+                end = 0xFFFFFFFFULL;
+        }
+        // start <= addr <= end as a single unsigned comparison
+        offset = newIRTemp(sbOut->tyenv, tyW);
+        in = newIRTemp(sbOut->tyenv, Ity_I1);
+        addStmtToIRSB(sbOut, IRStmt_WrTmp(offset,
+                      IRExpr_Binop(tyW == Ity_I32 ? Iop_Sub32 : Iop_Sub64, addr, mkWordConst(tyW, start))));
+        addStmtToIRSB(sbOut, IRStmt_WrTmp(in,
+                      IRExpr_Binop(tyW == Ity_I32 ? Iop_CmpLE32U : Iop_CmpLE64U,
+                                   IRExpr_RdTmp(offset), mkWordConst(tyW, end - start))));
+        if(any == NULL)
+            any = mkWiden1(sbOut, IRExpr_RdTmp(in));
+        else
+        {
+            t = newIRTemp(sbOut->tyenv, Ity_I32);
+            addStmtToIRSB(sbOut, IRStmt_WrTmp(t, IRExpr_Binop(Iop_Or32, any, mkWiden1(sbOut, IRExpr_RdTmp(in)))));
+            any = IRExpr_RdTmp(t);
+        }
+    }
+    if(any == NULL)
+    {
+        di->guard = IRExpr_Const(IRConst_U1(False));
+        return;
+    }
+    // Keep the guard of a LoadG or StoreG
+    if(di->guard->tag != Iex_Const)
+    {
+        t = newIRTemp(sbOut->tyenv, Ity_I32);
+        addStmtToIRSB(sbOut, IRStmt_WrTmp(t, IRExpr_Binop(Iop_And32, any, mkWiden1(sbOut, di->guard))));
+        any = IRExpr_RdTmp(t);
+    }
+    t = newIRTemp(sbOut->tyenv, Ity_I1);
+    addStmtToIRSB(sbOut, IRStmt_WrTmp(t, IRExpr_Binop(Iop_CmpNE32, any, IRExpr_Const(IRConst_U32(0)))));
+    di->guard = IRExpr_RdTmp(t);
 }
 
 static IRSB* tg_instrument(VgCallbackClosure* closure,
@@ -525,11 +1185,12 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                             IRType gWordTy, IRType hWordTy)
 {
     IRDirty*   di;
-    Int        i, j;
+    Int        i;
     IRSB*      sbOut;
-    IRExpr **argv, *arg1, *arg2, *arg3;
+    IRExpr **argv, *arg1, *arg2;
     Addr64 last_addr;
     Bool trace_instr = False;
+    Int code_end = 0;
     if (gWordTy != hWordTy)
     {
         VG_(tool_panic)("host/guest word size mismatch");
@@ -545,13 +1206,9 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
         addStmtToIRSB( sbOut, sbIn->stmts[i] );
         i++;
     }
-    if(filter_instr_number == 0)
+    if(filter_instr_number == 0 ||
+       inFilterRanges(&filter_instr_ranges, sbIn->stmts[i]->Ist.IMark.addr))
         trace_instr = True;
-    else
-        for(j = 0; j < filter_instr_number; j++)
-            if(filter_instr_start[j] <= sbIn->stmts[i]->Ist.IMark.addr &&
-               filter_instr_end[j] >= sbIn->stmts[i]->Ist.IMark.addr)
-                trace_instr = True;
     for(; i < sbIn->stmts_used; i++)
     {
         IRStmt* st = sbIn->stmts[i];
@@ -560,14 +1217,16 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
             if(st->tag == Ist_IMark)
             {
                 last_addr = st->Ist.IMark.addr;
-                arg1 = mkIRExpr_HWord((HWord)st->Ist.IMark.addr);
-                arg2 = mkIRExpr_HWord((HWord)st->Ist.IMark.delta);
-                arg3 = mkIRExpr_HWord((HWord)st->Ist.IMark.len);
-                argv = mkIRExprVec_3(arg1, arg2, arg3);
-                di = unsafeIRDirty_0_N(3, "instructionCallback",
-                                       VG_(fnptr_to_fnentry)(&instructionCallback),
-                                       argv);
-                addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+                // One call records all the instructions until the next exit
+                if(i >= code_end)
+                {
+                    arg1 = mkIRExpr_HWord((HWord)makeCodeDesc(sbIn, i, &code_end));
+                    argv = mkIRExprVec_1(arg1);
+                    di = unsafeIRDirty_0_N(1, "codeCallback",
+                                           VG_(fnptr_to_fnentry)(&codeCallback),
+                                           argv);
+                    addStmtToIRSB(sbOut, IRStmt_Dirty(di));
+                }
             }
             else if(st->tag == Ist_LoadG)
             {
@@ -587,6 +1246,7 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                                        VG_(fnptr_to_fnentry)(&readCallback),
                                        argv);
                 di->guard = st->Ist.LoadG.details->guard;
+                addMemFilterGuard(sbOut, gWordTy, di);
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
             else if(st->tag == Ist_LLSC)
@@ -599,6 +1259,7 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                     di = unsafeIRDirty_0_N(3, "readCallback",
                                            VG_(fnptr_to_fnentry)(&readCallback),
                                            argv);
+                    addMemFilterGuard(sbOut, gWordTy, di);
                     addStmtToIRSB(sbOut, IRStmt_Dirty(di));
                 }
             }
@@ -612,6 +1273,7 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                     di = unsafeIRDirty_0_N(3, "readCallback",
                                            VG_(fnptr_to_fnentry)(&readCallback),
                                            argv);
+                    addMemFilterGuard(sbOut, gWordTy, di);
                     addStmtToIRSB(sbOut, IRStmt_Dirty(di));
                 }
             }
@@ -624,6 +1286,7 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                 di = unsafeIRDirty_0_N(3, "readCallback",
                                            VG_(fnptr_to_fnentry)(&readCallback),
                                            argv);
+                addMemFilterGuard(sbOut, gWordTy, di);
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
             else if(st->tag == Ist_Dirty && st->Ist.Dirty.details->mFx != Ifx_None)
@@ -644,6 +1307,7 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                                        VG_(fnptr_to_fnentry)(&writeCallback),
                                        argv);
                 di->guard = st->Ist.StoreG.details->guard;
+                addMemFilterGuard(sbOut, gWordTy, di);
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
             else if(st->tag == Ist_Store)
@@ -654,6 +1318,7 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                 di = unsafeIRDirty_0_N(3, "writeCallback",
                                        VG_(fnptr_to_fnentry)(&writeCallback),
                                        argv);
+                addMemFilterGuard(sbOut, gWordTy, di);
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
             else if(st->tag == Ist_LLSC && st->Ist.LLSC.storedata != NULL)
@@ -664,6 +1329,7 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                 di = unsafeIRDirty_0_N(3, "writeCallback",
                                        VG_(fnptr_to_fnentry)(&writeCallback),
                                        argv);
+                addMemFilterGuard(sbOut, gWordTy, di);
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
             else if(st->tag == Ist_CAS)
@@ -679,6 +1345,7 @@ static IRSB* tg_instrument(VgCallbackClosure* closure,
                 di = unsafeIRDirty_0_N(3, "writeCallback",
                                            VG_(fnptr_to_fnentry)(&writeCallback),
                                            argv);
+                addMemFilterGuard(sbOut, gWordTy, di);
                 addStmtToIRSB(sbOut, IRStmt_Dirty(di));
             }
         }
@@ -690,7 +1357,7 @@ static void tg_fini(Int exitcode)
 {
     DebugInfo *di = NULL;
     LibMsg lib_msg;
-    flushCodeEvents();
+    flushAllEvents();
     while((di = VG_(next_DebugInfo)(di)) != NULL)
     {
         lib_msg.name = VG_(DebugInfo_get_filename)(di);
@@ -698,6 +1365,7 @@ static void tg_fini(Int exitcode)
         lib_msg.end = lib_msg.base + VG_(DebugInfo_get_text_size)(di);
         sendLibMsg(trace_output_fd, &lib_msg);
     }
+    flushOutput(trace_output_fd);
     VG_(close)(trace_output_fd);
 }
 
@@ -722,6 +1390,9 @@ static void tg_pre_clo_init(void)
    VG_(track_pre_thread_ll_exit)(threadExitedCallback);
    VG_(track_new_mem_startup)(trackMemCallback);
    VG_(track_new_mem_mmap)(trackMemCallback);
+   VG_(track_pre_deliver_signal)(preDeliverSignalCallback);
+   VG_(atfork)(forkCallback, NULL, NULL);
+   VG_(needs_syscall_wrapper)(preSyscallCallback, postSyscallCallback);
 }
 
 VG_DETERMINE_INTERFACE_VERSION(tg_pre_clo_init)
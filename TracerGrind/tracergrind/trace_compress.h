@@ -0,0 +1,207 @@
+/* ===================================================================== */
+/* This file is part of TracerGrind                                      */
+/* TracerGrind is an execution tracing module for Valgrind               */
+/* Copyright (C) 2016                                                    */
+/* Original author:   Charles Hubain <me@haxelion.eu>                    */
+/* Contributors:      Phil Teuwen <phil@teuwen.org>                      */
+/*                    Joppe Bos <joppe_bos@hotmail.com>                  */
+/*                    Wil Michiels <w.p.a.j.michiels@tue.nl>             */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* any later version.                                                    */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/* ===================================================================== */
+#ifndef TRACE_COMPRESS_H
+#define TRACE_COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A compressed trace starts with TRACE_COMPRESS_MAGIC, which can not be
+// mistaken for a message type, followed by blocks of at most
+// TRACE_COMPRESS_BLOCK_SIZE bytes of the raw trace:
+//   uint32_t raw_size, uint32_t compressed_size, data
+// The data of a block uses the LZ4 block format. A block which does not
+// compress is stored as is with compressed_size == raw_size.
+//
+// This file does not use the C library so that it builds inside Valgrind.
+
+static const uint8_t TRACE_COMPRESS_MAGIC[4] = {'T', 'G', 'L', 'Z'};
+
+#define TRACE_COMPRESS_BLOCK_SIZE (1024*1024)
+#define TRACE_COMPRESS_HEADER_SIZE 8
+#define TRACE_COMPRESS_BOUND(size) ((size) + (size)/255 + 16)
+#define TRACE_COMPRESS_HASH_BITS 14
+#define TRACE_COMPRESS_HASH_SIZE (1 << TRACE_COMPRESS_HASH_BITS)
+
+static inline uint32_t trace_compress_get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void trace_compress_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline size_t trace_compress_length(uint8_t *dst, size_t length)
+{
+    size_t op = 0;
+    while(length >= 255)
+    {
+        dst[op++] = 255;
+        length -= 255;
+    }
+    dst[op++] = length;
+    return op;
+}
+
+// Compress size bytes of src, at most TRACE_COMPRESS_BLOCK_SIZE, into dst
+// which must hold TRACE_COMPRESS_BOUND(size) bytes. table is a scratch
+// array of TRACE_COMPRESS_HASH_SIZE entries. Return the compressed size.
+static inline size_t trace_compress(const uint8_t *src, size_t size, uint8_t *dst, uint32_t *table)
+{
+    size_t ip = 0, anchor = 0, op = 0, i;
+    // The format requires the last match to start 12 bytes before the end
+    // and the last 5 bytes to be literals
+    size_t match_limit = size > 12 ? size - 12 : 0;
+    size_t end_limit = size > 5 ? size - 5 : 0;
+
+    for(i = 0; i < TRACE_COMPRESS_HASH_SIZE; i++)
+        table[i] = 0;
+    while(ip < match_limit)
+    {
+        uint32_t sequence = trace_compress_get32(&(src[ip]));
+        uint32_t h = (sequence * 2654435761U) >> (32 - TRACE_COMPRESS_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = ip;
+        if(candidate < ip && ip - candidate <= 65535 &&
+           trace_compress_get32(&(src[candidate])) == sequence)
+        {
+            size_t literals = ip - anchor, length = 4, offset = ip - candidate;
+            uint8_t *token = &(dst[op++]);
+            while(ip + length < end_limit && src[candidate + length] == src[ip + length])
+                length++;
+            if(literals >= 15)
+            {
+                *token = 15 << 4;
+                op += trace_compress_length(&(dst[op]), literals - 15);
+            }
+            else
+                *token = literals << 4;
+            for(i = 0; i < literals; i++)
+                dst[op++] = src[anchor + i];
+            dst[op++] = offset;
+            dst[op++] = offset >> 8;
+            if(length - 4 >= 15)
+            {
+                *token |= 15;
+                op += trace_compress_length(&(dst[op]), length - 4 - 15);
+            }
+            else
+                *token |= length - 4;
+            ip += length;
+            anchor = ip;
+        }
+        else
+            // Skip faster through data which does not compress
+            ip += 1 + ((ip - anchor) >> 6);
+    }
+    // Last literals
+    if(size - anchor >= 15)
+    {
+        dst[op++] = 15 << 4;
+        op += trace_compress_length(&(dst[op]), size - anchor - 15);
+    }
+    else
+        dst[op++] = (size - anchor) << 4;
+    for(i = anchor; i < size; i++)
+        dst[op++] = src[i];
+    return op;
+}
+
+// Decompress a block of size bytes into raw_size bytes of dst, return -1 if
+// the block is corrupted
+static inline int trace_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t raw_size)
+{
+    size_t ip = 0, op = 0, i;
+    while(ip < size)
+    {
+        uint8_t token = src[ip++];
+        size_t literals = token >> 4, length, offset;
+        if(literals == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if(ip >= size)
+                    return -1;
+                b = src[ip++];
+                literals += b;
+            } while(b == 255);
+        }
+        if(literals > size - ip || literals > raw_size - op)
+            return -1;
+        for(i = 0; i < literals; i++)
+            dst[op++] = src[ip++];
+        if(ip == size)
+            break;
+        if(size - ip < 2)
+            return -1;
+        offset = src[ip] | (src[ip+1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > op)
+            return -1;
+        length = token & 15;
+        if(length == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if(ip >= size)
+                    return -1;
+                b = src[ip++];
+                length += b;
+            } while(b == 255);
+        }
+        length += 4;
+        if(length > raw_size - op)
+            return -1;
+        // The match may overlap the bytes being written
+        for(i = 0; i < length; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op == raw_size ? 0 : -1;
+}
+
+// Write the header and the data of a block to dst, which must hold
+// TRACE_COMPRESS_HEADER_SIZE + TRACE_COMPRESS_BOUND(size) bytes. Return
+// the number of bytes written.
+static inline size_t trace_compress_block(const uint8_t *src, size_t size, uint8_t *dst, uint32_t *table)
+{
+    size_t compressed_size = trace_compress(src, size, &(dst[TRACE_COMPRESS_HEADER_SIZE]), table);
+    if(compressed_size >= size)
+    {
+        size_t i;
+        for(i = 0; i < size; i++)
+            dst[TRACE_COMPRESS_HEADER_SIZE + i] = src[i];
+        compressed_size = size;
+    }
+    trace_compress_put32(dst, size);
+    trace_compress_put32(&(dst[4]), compressed_size);
+    return TRACE_COMPRESS_HEADER_SIZE + compressed_size;
+}
+
+#endif // TRACE_COMPRESS_H
@@ -20,15 +20,57 @@
 /* You should have received a copy of the GNU General Public License     */
 /* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 /* ===================================================================== */
+#ifndef TRACE_PROTOCOL_H
+#define TRACE_PROTOCOL_H
+
 #include <stdint.h>
 
+// Protocol 1 writes every integer on 8 bytes. Protocol 2 is announced by a
+// PROTOCOL info message written with protocol 1 as the first message of the
+// trace. It changes the encoding of the messages which follow:
+// * the message length is a varint which does not count the header;
+// * exec_id is zigzag delta encoded against the exec_id of the previous
+//   message, number, length, thread_id, base and end are varints;
+// * the first address of an ExecMsg is zigzag delta encoded against the
+//   first address of the previous ExecMsg, the next ones against the end
+//   of the instruction before them;
+// * ins_address and start_address of a MemoryMsg are zigzag delta encoded
+//   against those of the previous MemoryMsg.
+// Fields are in the order of the structures below. Strings, lengths, code,
+// mode and type are unchanged.
+//
+// Protocol 3 uses the encoding of protocol 2. A BlockMsg defines the code
+// of a block once and the executions of the block are ExecBlockMsg which
+// only give its block_id. Block ids are numbered from 0. The addresses of a
+// BlockMsg are encoded like those of an ExecMsg.
+//
+// Protocol 4 adds MemoryRangeMsg to protocol 3. Consecutive memory accesses
+// of a block with the same mode which touch adjacent bytes are sent as one
+// range: exec_id, mode, start_address and number are followed by the
+// ins_address and length of each access, then by the data of the range.
+// ins_address is encoded like in a MemoryMsg.
+//
+// A StampMsg can appear with any protocol, its fields use the encoding of
+// the trace like those of a ThreadMsg. It gives the stamp of the ExecMsg
+// with the same exec_id which follows it. TracerPIN writes the threads one
+// buffer at a time and takes the stamps from a counter shared by all of
+// them, ordering the ExecMsg by stamp gives the execution order.
+#define PROTOCOL_VERSION_MAX 4
+// Largest varint and message header
+#define VARINT_MAX_SIZE 10
+#define MSG_HEADER_MAX_SIZE (1 + VARINT_MAX_SIZE)
+
 typedef enum _MsgType
 {
     MSG_INFO = 0,
     MSG_LIB,
     MSG_EXEC,
     MSG_MEMORY,
-    MSG_THREAD
+    MSG_THREAD,
+    MSG_BLOCK,
+    MSG_EXEC_BLOCK,
+    MSG_MEMORY_RANGE,
+    MSG_STAMP
 } MsgType;
 
 typedef enum _MemoryMode
@@ -75,6 +117,23 @@ typedef struct _ExecMsg
     uint8_t *code;
 } ExecMsg;
 
+typedef struct _BlockMsg
+{
+    uint64_t block_id;
+    uint64_t number;
+    uint64_t length;
+    uint64_t *addresses;
+    uint8_t *lengths;
+    uint8_t *code;
+} BlockMsg;
+
+typedef struct _ExecBlockMsg
+{
+    uint64_t exec_id;
+    uint64_t thread_id;
+    uint64_t block_id;
+} ExecBlockMsg;
+
 typedef struct _MemoryMsg
 {
     uint64_t exec_id;
@@ -92,7 +151,53 @@ typedef struct _ThreadMsg
     uint8_t type;
 } ThreadMsg;
 
-static const char* STR_TRACERGRIND_VERSION = "TRACERGRIND_VERSION";
-static const char* STR_ARCH = "ARCH";
-static const char* STR_PROGRAM = "PROGRAM";
-static const char* STR_ARGS = "ARGS";
+typedef struct _StampMsg
+{
+    uint64_t exec_id;
+    uint64_t stamp;
+} StampMsg;
+
+static const char* const STR_TRACERGRIND_VERSION = "TRACERGRIND_VERSION";
+static const char* const STR_ARCH = "ARCH";
+static const char* const STR_PROGRAM = "PROGRAM";
+static const char* const STR_ARGS = "ARGS";
+static const char* const STR_PROTOCOL = "PROTOCOL";
+
+static inline uint64_t zigzagEncode(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzagDecode(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Return the number of bytes written
+static inline int putVarint(uint8_t *p, uint64_t v)
+{
+    int i = 0;
+    while(v >= 0x80)
+    {
+        p[i++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[i++] = (uint8_t)v;
+    return i;
+}
+
+// Return the number of bytes read, 0 if the varint does not end before end
+static inline int getVarint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    int i;
+    *v = 0;
+    for(i = 0; i < VARINT_MAX_SIZE && p + i < end; i++)
+    {
+        *v |= (uint64_t)(p[i] & 0x7f) << (7*i);
+        if((p[i] & 0x80) == 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+#endif // TRACE_PROTOCOL_H
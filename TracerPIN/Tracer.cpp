@@ -25,9 +25,14 @@
 #include <fstream>
 #include <sstream>
 #include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include <map>
+#include <deque>
+#include <vector>
 #include "sqlite3.h"
+#include "../TracerGrind/tracergrind/trace_protocol.h"
+#include "../TracerGrind/tracergrind/trace_compress.h"
 #include <sys/time.h>
 #include <sys/syscall.h>
 #include <sys/stat.h>
@@ -69,25 +74,128 @@ bool filter_live_reached=false;
 bool quiet=false;
 long long bigcounter=0; // Ready for 4 billions of instructions
 long long currentbbl=0;
+// Taken by each basic block when it is executed, without any lock, so that
+// the blocks of all threads can be ordered after the buffers are written
+volatile UINT64 block_stamp=0;
 enum InfoTypeType { T, C, B, R, I, W };
 InfoTypeType InfoType=T;
 std::string TraceName;
 sqlite3 *db;
-sqlite3_int64 bbl_id = 0, ins_id = 0;
-sqlite3_stmt *info_insert, *bbl_insert, *call_insert, *lib_insert, *ins_insert, *mem_insert, *thread_insert, *thread_update;
+sqlite3_stmt *info_insert, *call_insert, *lib_insert, *thread_insert, *thread_update;
 
-enum LogTypeType { HUMAN, SQLITE };
+/* ===================================================================== */
+/* Per-thread event buffers                                              */
+/* ===================================================================== */
+
+// Analysis routines only append raw events to a buffer owned by the
+// current thread, without taking any lock. Full buffers are handed over
+// to the writer thread which formats them into the trace under _lock.
+#define EVENT_BUFFER_SIZE (1 << 20)
+// Threads wait for the writer once that many full buffers are queued
+#define EVENT_BUFFER_QUEUE_MAX 64
+#define EVENT_NAME_MAX 1024
+#define INS_SIZE_MAX 32
+#define MEMDUMP_SIZE_MAX 256
+// A write is logged after its instruction, it has to land in the same buffer
+// or another thread could write later ins rows before its mem row
+#define WRITE_EVENT_MAX ((sizeof(event_t) + MEMDUMP_SIZE_MAX + 7) & ~(size_t)7)
+
+// Static data of an instruction, built once at instrumentation time
+struct insdata_t
+{
+    ADDRINT ip;
+    UINT32 size;
+    UINT8 bytes[INS_SIZE_MAX];
+    string disass;
+    string op_human;     // " %02x %02x..." as printed in the human trace
+    sqlite3_int64 static_ins_id; // row in static_ins, 0 until first written
+};
+
+typedef std::map<ADDRINT, insdata_t *> insmap_t;
+
+insmap_t ins_data;
+
+struct event_t
+{
+    UINT8 type;          // InfoTypeType of the event
+    UINT8 flag;          // 'R'/'W' for memory, prefetch, thread start/finish
+    UINT16 length;       // record length, payload included
+    UINT32 size;         // instruction, basic block or memory access size
+    ADDRINT ip;
+    union
+    {
+        ADDRINT addr;
+        insdata_t *ins;
+        INT32 code;
+        UINT64 stamp;    // basic block: value of block_stamp
+    };
+    // Followed by the payload: memory dump or call names
+};
+
+struct threaddata_t;
+
+struct evbuffer_t
+{
+    threaddata_t *owner;
+    size_t used;
+    UINT8 data[EVENT_BUFFER_SIZE];
+};
+
+struct threaddata_t
+{
+    PIN_THREAD_UID uid;
+    evbuffer_t *buffer;
+    // RecordWriteAddrSize -> RecordMemWrite
+    ADDRINT write_addr;
+    INT32 write_size;
+    // Only used by the writer
+    sqlite3_int64 bbl_id, ins_id;
+    std::string pending_reads;
+    // Binary trace: contiguous instructions and their memory accesses,
+    // sent as one MSG_EXEC preceded by its MSG_MEMORY
+    std::vector<UINT64> exec_addresses;
+    std::string exec_lengths, exec_code, exec_mem;
+    // Stamp of the basic block of the pending instructions
+    bool exec_stamped;
+    UINT64 exec_stamp;
+};
+
+TLS_KEY tls_key;
+PIN_LOCK buffers_lock;
+PIN_SEMAPHORE buffers_ready;
+PIN_SEMAPHORE buffers_written;
+PIN_THREAD_UID writer_uid;
+volatile bool writer_stop = false;
+std::deque<evbuffer_t *> full_buffers;
+std::vector<evbuffer_t *> free_buffers;
+std::vector<threaddata_t *> threads;
+
+enum LogTypeType { HUMAN, SQLITE, BINARY };
 static const char *SETUP_QUERY = 
 "CREATE TABLE IF NOT EXISTS info (key TEXT PRIMARY KEY, value TEXT);\n"
-"CREATE TABLE IF NOT EXISTS lib (name TEXT, base TEXT, end TEXT);\n"
-"CREATE TABLE IF NOT EXISTS bbl (addr TEXT, addr_end TEXT, size INTEGER, thread_id INTEGER);\n"
-"CREATE TABLE IF NOT EXISTS call (ins_id INTEGER, addr TEXT, name TEXT);\n"
-"CREATE TABLE IF NOT EXISTS ins (bbl_id INTEGER, ip TEXT, dis TEXT, op TEXT);\n"
-"CREATE TABLE IF NOT EXISTS mem (ins_id INTEGER, ip TEXT, type TEXT, addr TEXT, addr_end TEXT, size INTEGER, data TEXT, value TEXT);\n"
+"CREATE TABLE IF NOT EXISTS lib (name TEXT, base INTEGER, end INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS bbl (addr INTEGER, addr_end INTEGER, size INTEGER, thread_id INTEGER, stamp INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS call (ins_id INTEGER, addr INTEGER, name TEXT);\n"
+"CREATE TABLE IF NOT EXISTS static_ins (id INTEGER PRIMARY KEY, ip INTEGER, dis TEXT, op BLOB);\n"
+"CREATE TABLE IF NOT EXISTS ins (bbl_id INTEGER, static_ins_id INTEGER);\n"
+"CREATE TABLE IF NOT EXISTS mem (ins_id INTEGER, ip INTEGER, type TEXT, addr INTEGER, addr_end INTEGER, size INTEGER, data BLOB, value INTEGER);\n"
 "CREATE TABLE IF NOT EXISTS thread (thread_id INTEGER, start_bbl_id INTEGER, exit_bbl_id INTEGER);\n";
+// Built once the whole trace is written, TraceGraph reads the blocks in
+// stamp order and their instructions and memory accesses through them
+static const char *INDEX_QUERY =
+"CREATE INDEX IF NOT EXISTS mem_ins_id ON mem (ins_id);\n"
+"CREATE INDEX IF NOT EXISTS ins_bbl_id ON ins (bbl_id);\n"
+"CREATE INDEX IF NOT EXISTS mem_addr ON mem (addr);\n"
+"CREATE INDEX IF NOT EXISTS bbl_stamp ON bbl (stamp);\n"
+"INSERT OR REPLACE INTO info (key, value) VALUES ('INDEXES', 'mem.ins_id,ins.bbl_id,mem.addr,bbl.stamp');\n";
 
 LogTypeType LogType=HUMAN;
 
+// Version 1 had no static_ins table, ip/dis/op were in each ins row
+// Version 2 stored addresses, opcodes and memory data as hex TEXT
+// Version 3 had no bbl.stamp, the blocks of the threads could not be ordered
+#define SCHEMA_VERSION "4"
+
 /* ===================================================================== */
 /* Commandline Switches */
 /* ===================================================================== */
@@ -111,7 +219,9 @@ KNOB<string> KnobLogFilterLive(KNOB_MODE_WRITEONCE, "pintool",
 KNOB<INT> KnobLogFilterLiveN(KNOB_MODE_WRITEONCE, "pintool",
                            "n", "0", "which occurence to log, 0=all (only for -F start:stop filter)");
 KNOB<string> KnobLogType(KNOB_MODE_WRITEONCE, "pintool",
-                         "t", "human", "log type: human/sqlite");
+                         "t", "human", "log type: human/sqlite/binary");
+KNOB<BOOL> KnobCompress(KNOB_MODE_WRITEONCE, "pintool",
+                         "z", "0", "compress the binary trace");
 KNOB<BOOL> KnobQuiet(KNOB_MODE_WRITEONCE, "pintool",
                        "q", "0", "be quiet under normal conditions");
 
@@ -237,63 +347,419 @@ BOOL ExcludedAddressLive(ADDRINT ip)
 }
 
 /* ===================================================================== */
-/* Helper Functions for Instruction_cb                                   */
+/* Helper Functions for the event buffers                                */
 /* ===================================================================== */
 
-VOID printInst(ADDRINT ip, string *disass, INT32 size)
+static evbuffer_t *NewBuffer(threaddata_t *owner)
 {
-    UINT8 v[32];
-    // test on logfilterlive here to avoid calls when not using live filtering
-    if (logfilterlive && ExcludedAddressLive(ip))
+    evbuffer_t *buffer;
+    PIN_GetLock(&buffers_lock, 0);
+    if (free_buffers.empty())
+    {
+        buffer = new evbuffer_t;
+    }
+    else
+    {
+        buffer = free_buffers.back();
+        free_buffers.pop_back();
+    }
+    PIN_ReleaseLock(&buffers_lock);
+    buffer->owner = owner;
+    buffer->used = 0;
+    return buffer;
+}
+
+// Hand the current buffer of a thread over to the writer
+static VOID FlushBuffer(threaddata_t *td)
+{
+    PIN_GetLock(&buffers_lock, 0);
+    // Bound the memory used when the writer falls behind
+    while ((full_buffers.size() >= EVENT_BUFFER_QUEUE_MAX) && !writer_stop)
+    {
+        PIN_SemaphoreClear(&buffers_written);
+        PIN_ReleaseLock(&buffers_lock);
+        PIN_SemaphoreSet(&buffers_ready);
+        PIN_SemaphoreWait(&buffers_written);
+        PIN_GetLock(&buffers_lock, 0);
+    }
+    full_buffers.push_back(td->buffer);
+    PIN_ReleaseLock(&buffers_lock);
+    td->buffer = NULL;
+    PIN_SemaphoreSet(&buffers_ready);
+}
+
+static inline threaddata_t *GetThreadData(THREADID tid)
+{
+    return static_cast<threaddata_t *>(PIN_GetThreadData(tls_key, tid));
+}
+
+// Room is kept for reserve more bytes after the event in the same buffer
+static inline event_t *AllocEvent(threaddata_t *td, size_t payload, size_t reserve = 0)
+{
+    size_t length = (sizeof(event_t) + payload + 7) & ~(size_t)7;
+    if (td->buffer->used + length + reserve > EVENT_BUFFER_SIZE)
+    {
+        FlushBuffer(td);
+        td->buffer = NewBuffer(td);
+    }
+    event_t *ev = (event_t *) &(td->buffer->data[td->buffer->used]);
+    td->buffer->used += length;
+    ev->length = length;
+    return ev;
+}
+
+/* ===================================================================== */
+/* Helper Functions for the binary trace                                 */
+/* ===================================================================== */
+
+// Same messages as TracerGrind, see trace_protocol.h, so that the trace can
+// be converted offline with texttrace or sqlitetrace
+#define MAX_CODE_EVENT 4096
+UINT64 exec_id = 0;
+std::string msg_buffer;
+
+static inline VOID PutMsgBytes(const VOID *data, size_t size)
+{
+    msg_buffer.append((const char *)data, size);
+}
+
+static inline VOID PutMsgU8(UINT8 data)
+{
+    PutMsgBytes(&data, 1);
+}
+
+static inline VOID PutMsgU64(UINT64 data)
+{
+    PutMsgBytes(&data, 8);
+}
+
+static VOID BeginMsg(UINT8 type)
+{
+    msg_buffer.clear();
+    PutMsgU8(type);
+    PutMsgU64(0);
+}
+
+// Compressed traces are written by blocks, see trace_compress.h
+std::string compress_input;
+std::vector<UINT8> compress_output(TRACE_COMPRESS_HEADER_SIZE + TRACE_COMPRESS_BOUND(TRACE_COMPRESS_BLOCK_SIZE));
+std::vector<UINT32> compress_table(TRACE_COMPRESS_HASH_SIZE);
+
+// Write the complete blocks, and the last incomplete one if final
+static VOID WriteCompressed(bool final)
+{
+    size_t offset = 0;
+    while (compress_input.size() - offset >= TRACE_COMPRESS_BLOCK_SIZE ||
+           (final && offset < compress_input.size()))
+    {
+        size_t size = compress_input.size() - offset;
+        if (size > TRACE_COMPRESS_BLOCK_SIZE)
+            size = TRACE_COMPRESS_BLOCK_SIZE;
+        size_t written = trace_compress_block((const UINT8 *) compress_input.data() + offset, size,
+                                              &(compress_output[0]), &(compress_table[0]));
+        TraceFile.write((const char *) &(compress_output[0]), written);
+        offset += size;
+    }
+    compress_input.erase(0, offset);
+}
+
+static VOID SendMsg()
+{
+    UINT64 length = msg_buffer.size();
+    msg_buffer.replace(1, 8, (const char *)&length, 8);
+    if (KnobCompress.Value())
+    {
+        compress_input.append(msg_buffer);
+        if (compress_input.size() >= TRACE_COMPRESS_BLOCK_SIZE)
+            WriteCompressed(false);
+    }
+    else
+        TraceFile.write(msg_buffer.data(), msg_buffer.size());
+}
+
+static VOID SendInfoMsg(const char *key, const string &value)
+{
+    BeginMsg(MSG_INFO);
+    PutMsgBytes(key, strlen(key) + 1);
+    PutMsgBytes(value.c_str(), value.size() + 1);
+    SendMsg();
+}
+
+static VOID SendLibMsg(const string &name, ADDRINT base, ADDRINT end)
+{
+    BeginMsg(MSG_LIB);
+    PutMsgU64(base);
+    PutMsgU64(end);
+    PutMsgBytes(name.c_str(), name.size() + 1);
+    SendMsg();
+}
+
+static VOID SendThreadMsg(threaddata_t *td, UINT8 type)
+{
+    BeginMsg(MSG_THREAD);
+    PutMsgU64(exec_id);
+    PutMsgU64(td->uid);
+    PutMsgU8(type);
+    SendMsg();
+}
+
+static VOID SendStampMsg(UINT64 stamp)
+{
+    BeginMsg(MSG_STAMP);
+    PutMsgU64(exec_id);
+    PutMsgU64(stamp);
+    SendMsg();
+}
+
+static VOID SendMemoryMsg(const event_t *ev)
+{
+    BeginMsg(MSG_MEMORY);
+    PutMsgU64(exec_id);
+    PutMsgU64(ev->ip);
+    PutMsgU8(ev->type == R ? MODE_READ : MODE_WRITE);
+    PutMsgU64(ev->addr);
+    PutMsgU64(ev->size);
+    PutMsgBytes(ev + 1, ev->size);
+    SendMsg();
+}
+
+// Send the pending instructions of a thread with their memory accesses
+static VOID FlushExec(threaddata_t *td)
+{
+    if (td->exec_addresses.empty() && td->exec_mem.empty())
         return;
-    if ((size_t)size > sizeof(v))
+    if (td->exec_stamped && !td->exec_addresses.empty())
+        SendStampMsg(td->exec_stamp);
+    size_t offset = 0;
+    while (offset < td->exec_mem.size())
+    {
+        const event_t *ev = (const event_t *) &(td->exec_mem[offset]);
+        SendMemoryMsg(ev);
+        offset += ev->length;
+    }
+    if (!td->exec_addresses.empty())
+    {
+        BeginMsg(MSG_EXEC);
+        PutMsgU64(exec_id);
+        PutMsgU64(td->uid);
+        PutMsgU64(td->exec_addresses.size());
+        PutMsgU64(td->exec_code.size());
+        PutMsgBytes(&(td->exec_addresses[0]), 8 * td->exec_addresses.size());
+        PutMsgBytes(td->exec_lengths.data(), td->exec_lengths.size());
+        PutMsgBytes(td->exec_code.data(), td->exec_code.size());
+        SendMsg();
+    }
+    exec_id++;
+    td->exec_addresses.clear();
+    td->exec_lengths.clear();
+    td->exec_code.clear();
+    td->exec_mem.clear();
+}
+
+static VOID AppendExec(threaddata_t *td, const event_t *ev)
+{
+    // Only contiguous instructions can be disassembled as one block
+    if (!td->exec_addresses.empty() &&
+        ((td->exec_addresses.size() >= MAX_CODE_EVENT) ||
+         (td->exec_addresses.back() + (UINT8)td->exec_lengths[td->exec_lengths.size() - 1] != ev->ip)))
+        FlushExec(td);
+    td->exec_addresses.push_back(ev->ip);
+    td->exec_lengths.push_back((char)ev->size);
+    td->exec_code.append((const char *)ev->ins->bytes, ev->size);
+    // Reads were logged before the instruction
+    td->exec_mem.append(td->pending_reads);
+    td->pending_reads.clear();
+}
+
+/* ===================================================================== */
+/* Batched sqlite inserts                                                */
+/* ===================================================================== */
+
+// Rows are gathered in memory and written with one multi-row INSERT.
+// Rowids are assigned here so that ids are known without asking sqlite.
+// Stay under the default SQLITE_MAX_VARIABLE_NUMBER of older sqlite versions
+#define BATCH_MAX_VARIABLES 999
+
+struct batchvalue_t
+{
+    int type;
+    sqlite3_int64 integer;
+    size_t offset;
+    int length;
+};
+
+struct sqlbatch_t
+{
+    string table;
+    string columns;
+    int column_count;
+    int max_rows;
+    int rows;
+    sqlite3_int64 next_rowid;
+    std::vector<batchvalue_t> values;
+    std::string data;
+    sqlite3_stmt *insert;
+};
+
+sqlbatch_t bbl_batch, static_ins_batch, ins_batch, mem_batch;
+
+static sqlite3_stmt *BatchPrepare(sqlbatch_t *batch, int rows)
+{
+    sqlite3_stmt *stmt;
+    string query = "INSERT INTO " + batch->table + " (" + batch->columns + ") VALUES ";
+    string row = "(?";
+    for (int i = 1; i < batch->column_count; i++)
+        row += ",?";
+    row += ")";
+    for (int i = 0; i < rows; i++)
     {
-        cerr << "[!] Instruction size > 32 at " << dec << bigcounter << hex << (void *)ip << " " << *disass << endl;
+        if (i > 0)
+            query += ",";
+        query += row;
+    }
+    query += ";";
+    if (sqlite3_prepare_v2(db, query.c_str(), -1, &stmt, NULL) != SQLITE_OK)
+        cerr << "Could not prepare insert in " << batch->table << ": " << sqlite3_errmsg(db) << endl;
+    return stmt;
+}
+
+// columns lists the rowid column first, it is filled by BatchRow
+static VOID BatchInit(sqlbatch_t *batch, const char *table, const char *columns, int column_count)
+{
+    batch->table = table;
+    batch->columns = columns;
+    batch->column_count = column_count;
+    batch->max_rows = BATCH_MAX_VARIABLES / column_count;
+    batch->rows = 0;
+    // The database is created empty by main
+    batch->next_rowid = 1;
+    batch->values.resize(batch->max_rows * column_count);
+    batch->data.clear();
+    batch->insert = BatchPrepare(batch, batch->max_rows);
+}
+
+static VOID BatchFlush(sqlbatch_t *batch)
+{
+    if (batch->rows == 0)
         return;
+    sqlite3_stmt *stmt = (batch->rows == batch->max_rows) ? batch->insert : BatchPrepare(batch, batch->rows);
+    for (int i = 0; i < batch->rows * batch->column_count; i++)
+    {
+        const batchvalue_t &value = batch->values[i];
+        switch (value.type)
+        {
+        case SQLITE_INTEGER:
+            sqlite3_bind_int64(stmt, i + 1, value.integer);
+            break;
+        case SQLITE_TEXT:
+            sqlite3_bind_text(stmt, i + 1, batch->data.data() + value.offset, value.length, SQLITE_STATIC);
+            break;
+        case SQLITE_BLOB:
+            sqlite3_bind_blob(stmt, i + 1, batch->data.data() + value.offset, value.length, SQLITE_STATIC);
+            break;
+        default:
+            sqlite3_bind_null(stmt, i + 1);
+            break;
+        }
     }
-    PIN_GetLock(&_lock, ip);
+    if(sqlite3_step(stmt) != SQLITE_DONE)
+        printf("%s error: %s\n", batch->table.c_str(), sqlite3_errmsg(db));
+    if (stmt == batch->insert)
+        sqlite3_reset(stmt);
+    else
+        sqlite3_finalize(stmt);
+    batch->rows = 0;
+    batch->data.clear();
+}
+
+static VOID BatchFinalize(sqlbatch_t *batch)
+{
+    BatchFlush(batch);
+    sqlite3_finalize(batch->insert);
+}
+
+// Start a new row and return its rowid
+static sqlite3_int64 BatchRow(sqlbatch_t *batch)
+{
+    if (batch->rows == batch->max_rows)
+        BatchFlush(batch);
+    batchvalue_t *value = &(batch->values[batch->rows * batch->column_count]);
+    for (int i = 0; i < batch->column_count; i++)
+        value[i].type = SQLITE_NULL;
+    value[0].type = SQLITE_INTEGER;
+    value[0].integer = batch->next_rowid;
+    batch->rows++;
+    return batch->next_rowid++;
+}
+
+static inline batchvalue_t *BatchValue(sqlbatch_t *batch, int column)
+{
+    return &(batch->values[(batch->rows - 1) * batch->column_count + column]);
+}
+
+static VOID BatchInt64(sqlbatch_t *batch, int column, sqlite3_int64 integer)
+{
+    batchvalue_t *value = BatchValue(batch, column);
+    value->type = SQLITE_INTEGER;
+    value->integer = integer;
+}
+
+static VOID BatchBytes(sqlbatch_t *batch, int column, int type, const VOID *data, int length)
+{
+    batchvalue_t *value = BatchValue(batch, column);
+    value->type = type;
+    value->offset = batch->data.size();
+    value->length = length;
+    batch->data.append((const char *)data, length);
+}
+
+static VOID BatchText(sqlbatch_t *batch, int column, const string &text)
+{
+    BatchBytes(batch, column, SQLITE_TEXT, text.c_str(), text.size());
+}
+
+static VOID BatchBlob(sqlbatch_t *batch, int column, const VOID *data, int length)
+{
+    BatchBytes(batch, column, SQLITE_BLOB, data, length);
+}
+
+/* ===================================================================== */
+/* Helper Functions for Instruction_cb                                   */
+/* ===================================================================== */
+
+static VOID WritePendingReads(threaddata_t *td, sqlite3_int64 ins_id);
+
+static VOID WriteInst(threaddata_t *td, const event_t *ev)
+{
+    insdata_t *ins = ev->ins;
     if (InfoType >= I) bigcounter++;
     InfoType=I;
-    PIN_SafeCopy(v, (void *)ip, size);
     switch (LogType) {
         case HUMAN:
-            TraceFile << "[I]" << setw(10) << dec << bigcounter << hex << setw(16) << (void *)ip << "    " << setw(40) << left << *disass << right;
-            TraceFile << setfill('0');
-            for (INT32 i = 0; i < size; i++)
-            {
-                TraceFile << " " << setfill('0') << setw(2) << static_cast<UINT32>(v[i]);
-            }
-            TraceFile << setfill(' ');
-            TraceFile << endl;
+            TraceFile << "[I]" << setw(10) << dec << bigcounter << hex << setw(16) << (void *)ins->ip << "    " << setw(40) << left << ins->disass << right;
+            TraceFile << ins->op_human << endl;
             break;
         case SQLITE:
-            sqlite3_reset(ins_insert);
-            sqlite3_bind_int64(ins_insert, 1, bbl_id);
-            value.str("");
-            value.clear();
-            value << hex << "0x" << setfill('0') << setw(16) << ip;
-            strvalue = value.str();
-            sqlite3_bind_text(ins_insert, 2, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(ins_insert, 3, (*disass).c_str(), -1, SQLITE_TRANSIENT);
-            value.str("");
-            value.clear();
-            value << setfill('0') << hex;
-            for (INT32 i = 0; i < size; i++)
+            if (ins->static_ins_id == 0)
             {
-                value << setw(2) << static_cast<UINT32>(v[i]);
+                ins->static_ins_id = BatchRow(&static_ins_batch);
+                BatchInt64(&static_ins_batch, 1, ins->ip);
+                BatchText(&static_ins_batch, 2, ins->disass);
+                BatchBlob(&static_ins_batch, 3, ins->bytes, ins->size);
             }
-            strvalue = value.str();
-            sqlite3_bind_text(ins_insert, 4, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-            if(sqlite3_step(ins_insert) != SQLITE_DONE)
-                printf("INS error: %s\n", sqlite3_errmsg(db));
-            ins_id = sqlite3_last_insert_rowid(db);
+            td->ins_id = BatchRow(&ins_batch);
+            BatchInt64(&ins_batch, 1, td->bbl_id);
+            BatchInt64(&ins_batch, 2, ins->static_ins_id);
+            WritePendingReads(td, td->ins_id);
+            break;
+        case BINARY:
+            AppendExec(td, ev);
             break;
     }
 // To get context, see https://software.intel.com/sites/landingpage/pintool/docs/49306/Pin/html/group__CONTEXT__API.html
-    PIN_ReleaseLock(&_lock);
 }
 
-static VOID RecordMemHuman(ADDRINT ip, CHAR r, ADDRINT addr, UINT8* memdump, INT32 size, BOOL isPrefetch)
+static VOID RecordMemHuman(ADDRINT ip, CHAR r, ADDRINT addr, const UINT8* memdump, INT32 size, BOOL isPrefetch)
 {
     TraceFile << "[" << r << "]" << setw(10) << dec << bigcounter << hex << setw(16) << (void *) ip << "                                                   "
               << " " << setw(18) << (void *) addr << " size="
@@ -315,17 +781,17 @@ static VOID RecordMemHuman(ADDRINT ip, CHAR r, ADDRINT addr, UINT8* memdump, INT
 
         case 2:
             TraceFile << "0x" << setfill('0') << setw(4);
-            TraceFile << *(UINT16*)memdump;
+            TraceFile << *(const UINT16*)memdump;
             break;
 
         case 4:
             TraceFile << "0x" << setfill('0') << setw(8);
-            TraceFile << *(UINT32*)memdump;
+            TraceFile << *(const UINT32*)memdump;
             break;
 
         case 8:
             TraceFile << "0x" << setfill('0') << setw(16);
-            TraceFile << *(UINT64*)memdump;
+            TraceFile << *(const UINT64*)memdump;
             break;
 
         default:
@@ -339,84 +805,54 @@ static VOID RecordMemHuman(ADDRINT ip, CHAR r, ADDRINT addr, UINT8* memdump, INT
     TraceFile << setfill(' ') << endl;
 }
 
-static VOID RecordMemSqlite(ADDRINT ip, CHAR r, ADDRINT addr, UINT8* memdump, INT32 size, BOOL isPrefetch)
+static VOID RecordMemSqlite(sqlite3_int64 ins_id, ADDRINT ip, CHAR r, ADDRINT addr, const UINT8* memdump, INT32 size, BOOL isPrefetch)
 {
     // Insert read or write
-    sqlite3_reset(mem_insert);
-    sqlite3_bind_int64(mem_insert, 1, r == 'R' ? (ins_id+1) : ins_id );
-    value.str("");
-    value.clear();
-    value << hex << "0x" << setfill('0') << setw(16) << ip;
-    strvalue = value.str();
-    sqlite3_bind_text(mem_insert, 2, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-    char mode[2] = {0,0};
-    mode[0]=r;
-    sqlite3_bind_text(mem_insert, 3, mode, -1, SQLITE_TRANSIENT);
-    value.str("");
-    value.clear();
-    value << hex << "0x" << setfill('0') << setw(16) << addr;
-    strvalue = value.str();
-    sqlite3_bind_text(mem_insert, 4, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-    value.str("");
-    value.clear();
-    value << hex << "0x" << setfill('0') << setw(16) << addr;
-    strvalue = value.str();
-    sqlite3_bind_text(mem_insert, 5, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(mem_insert, 6, size);
-    if (!isPrefetch)
+    if (isPrefetch)
+        return;
+    BatchRow(&mem_batch);
+    BatchInt64(&mem_batch, 1, ins_id);
+    BatchInt64(&mem_batch, 2, ip);
+    BatchBytes(&mem_batch, 3, SQLITE_TEXT, &r, 1);
+    BatchInt64(&mem_batch, 4, addr);
+    BatchInt64(&mem_batch, 5, addr + size - 1);
+    BatchInt64(&mem_batch, 6, size);
+    BatchBlob(&mem_batch, 7, memdump, size);
+    switch(size)
     {
-        value.str("");
-        value.clear();
-        value << hex << setfill('0');
-        for (INT32 i = 0; i < size; i++)
-        {
-            value << setw(2) << static_cast<UINT32>(memdump[i]);
-        }
-        strvalue = value.str();
-        sqlite3_bind_text(mem_insert, 7, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-        value.str("");
-        value.clear();
-        value << hex  << "0x" << setfill('0');
-        switch(size)
-        {
-        case 0:
-            break;
-        case 1:
-            value << setw(2) << static_cast<UINT32>(*memdump);
-            break;
-        case 2:
-            value << setw(4) << *(UINT16*)memdump;
-            break;
-        case 4:
-            value << setw(8) << *(UINT32*)memdump;
-            break;
-        case 8:
-            value << setw(16) << *(UINT64*)memdump;
-            break;
-        default:
-            break;
-        }
-        strvalue = value.str();
-        sqlite3_bind_text(mem_insert, 8, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-        if(sqlite3_step(mem_insert) != SQLITE_DONE)
-            printf("MEM error: %s\n", sqlite3_errmsg(db));
+    case 1:
+        BatchInt64(&mem_batch, 8, *memdump);
+        break;
+    case 2:
+        BatchInt64(&mem_batch, 8, *(const UINT16*)memdump);
+        break;
+    case 4:
+        BatchInt64(&mem_batch, 8, *(const UINT32*)memdump);
+        break;
+    case 8:
+        BatchInt64(&mem_batch, 8, *(const UINT64*)memdump);
+        break;
+    default:
+        break;
     }
 }
 
-static VOID RecordMem(ADDRINT ip, CHAR r, ADDRINT addr, INT32 size, BOOL isPrefetch)
+// Reads are logged before their instruction, so they wait for its ins_id
+static VOID WritePendingReads(threaddata_t *td, sqlite3_int64 ins_id)
 {
-    UINT8 memdump[256];
-    // test on logfilterlive here to avoid calls when not using live filtering
-    if (logfilterlive && ExcludedAddressLive(ip))
-        return;
-    PIN_GetLock(&_lock, ip);
-    if ((size_t)size > sizeof(memdump))
+    size_t offset = 0;
+    while (offset < td->pending_reads.size())
     {
-        cerr << "[!] Memory size > " << sizeof(memdump) << " at " << dec << bigcounter << hex << (void *)ip << " " << (void *)addr << endl;
-        PIN_ReleaseLock(&_lock);
-        return;
+        const event_t *ev = (const event_t *) &(td->pending_reads[offset]);
+        RecordMemSqlite(ins_id, ev->ip, 'R', ev->addr, (const UINT8 *)(ev + 1), ev->size, ev->flag);
+        offset += ev->length;
     }
-    PIN_SafeCopy(memdump, (void *)addr, size);
+    td->pending_reads.clear();
+}
+
+static VOID WriteMem(threaddata_t *td, const event_t *ev)
+{
+    CHAR r = (ev->type == R) ? 'R' : 'W';
     switch (r) {
         case 'R':
             if (InfoType >= R) bigcounter++;
@@ -429,28 +865,100 @@ static VOID RecordMem(ADDRINT ip, CHAR r, ADDRINT addr, INT32 size, BOOL isPrefe
     }
     switch (LogType) {
         case HUMAN:
-            RecordMemHuman(ip, r, addr, memdump, size, isPrefetch);
+            RecordMemHuman(ev->ip, r, ev->addr, (const UINT8 *)(ev + 1), ev->size, ev->flag);
             break;
         case SQLITE:
-            RecordMemSqlite(ip, r, addr, memdump, size, isPrefetch);
+            if (r == 'R' && KnobLogIns.Value())
+                td->pending_reads.append((const char *)ev, ev->length);
+            else
+                RecordMemSqlite(td->ins_id, ev->ip, r, ev->addr, (const UINT8 *)(ev + 1), ev->size, ev->flag);
+            break;
+        case BINARY:
+            if (!KnobLogIns.Value())
+                SendMemoryMsg(ev);
+            else if (r == 'R')
+                td->pending_reads.append((const char *)ev, ev->length);
+            else
+                td->exec_mem.append((const char *)ev, ev->length);
             break;
     }
-    PIN_ReleaseLock(&_lock);
 }
 
-static ADDRINT WriteAddr;
-static INT32 WriteSize;
+VOID printInst(insdata_t *ins, THREADID tid)
+{
+    // test on logfilterlive here to avoid calls when not using live filtering
+    if (logfilterlive && ExcludedAddressLive(ins->ip))
+        return;
+    event_t *ev = AllocEvent(GetThreadData(tid), 0, KnobLogMem.Value() ? WRITE_EVENT_MAX : 0);
+    ev->type = I;
+    ev->size = ins->size;
+    ev->ip = ins->ip;
+    ev->ins = ins;
+}
+
+// Instructions are instrumented again each time PIN flushes its code cache,
+// reuse the record of an address unless its code changed
+static insdata_t *GetInsData(INS ins)
+{
+    ADDRINT ip = INS_Address(ins);
+    UINT32 size = INS_Size(ins);
+    UINT8 bytes[INS_SIZE_MAX];
+    PIN_SafeCopy(bytes, (void *)ip, size);
+    insmap_t::iterator it = ins_data.find(ip);
+    if ((it != ins_data.end()) && (it->second->size == size) &&
+        (memcmp(it->second->bytes, bytes, size) == 0))
+        return it->second;
+
+    // Older records may still be referenced by buffered events, never free them
+    insdata_t *insdata = new insdata_t;
+    insdata->ip = ip;
+    insdata->size = size;
+    memcpy(insdata->bytes, bytes, size);
+    insdata->disass = INS_Disassemble(ins);
+    insdata->static_ins_id = 0;
+    // Not the shared stringstream, the writer thread may be using it
+    std::ostringstream str;
+    str << hex << setfill('0');
+    for (UINT32 i = 0; i < size; i++)
+    {
+        str << " " << setw(2) << static_cast<UINT32>(bytes[i]);
+    }
+    insdata->op_human = str.str();
+    ins_data[ip] = insdata;
+    return insdata;
+}
+
+static VOID RecordMem(ADDRINT ip, CHAR r, ADDRINT addr, INT32 size, BOOL isPrefetch, THREADID tid)
+{
+    // test on logfilterlive here to avoid calls when not using live filtering
+    if (logfilterlive && ExcludedAddressLive(ip))
+        return;
+    if ((size_t)size > MEMDUMP_SIZE_MAX)
+    {
+        cerr << "[!] Memory size > " << MEMDUMP_SIZE_MAX << " at " << dec << bigcounter << hex << (void *)ip << " " << (void *)addr << endl;
+        return;
+    }
+    event_t *ev = AllocEvent(GetThreadData(tid), size);
+    ev->type = (r == 'R') ? R : W;
+    ev->flag = isPrefetch;
+    ev->size = size;
+    ev->ip = ip;
+    ev->addr = addr;
+    PIN_SafeCopy(ev + 1, (void *)addr, size);
+}
 
-static VOID RecordWriteAddrSize(ADDRINT addr, INT32 size)
+static VOID RecordWriteAddrSize(ADDRINT addr, INT32 size, THREADID tid)
 {
-    WriteAddr = addr;
-    WriteSize = size;
+    threaddata_t *td = GetThreadData(tid);
+    td->write_addr = addr;
+    td->write_size = size;
 }
 
 
-static VOID RecordMemWrite(ADDRINT ip)
+static VOID RecordMemWrite(ADDRINT ip, THREADID tid)
 {
-    RecordMem(ip, 'W', WriteAddr, WriteSize, false);
+    threaddata_t *td = GetThreadData(tid);
+    RecordMem(ip, 'W', td->write_addr, td->write_size, false, tid);
 }
 
 /* ================================================================================= */
@@ -473,6 +981,7 @@ VOID Instruction_cb(INS ins, VOID *v)
                 IARG_MEMORYREAD_EA,
                 IARG_MEMORYREAD_SIZE,
                 IARG_BOOL, INS_IsPrefetch(ins),
+                IARG_THREAD_ID,
                 IARG_END);
         }
 
@@ -485,6 +994,7 @@ VOID Instruction_cb(INS ins, VOID *v)
                 IARG_MEMORYREAD2_EA,
                 IARG_MEMORYREAD_SIZE,
                 IARG_BOOL, INS_IsPrefetch(ins),
+                IARG_THREAD_ID,
                 IARG_END);
         }
 
@@ -496,6 +1006,7 @@ VOID Instruction_cb(INS ins, VOID *v)
                 ins, IPOINT_BEFORE, (AFUNPTR)RecordWriteAddrSize,
                 IARG_MEMORYWRITE_EA,
                 IARG_MEMORYWRITE_SIZE,
+                IARG_THREAD_ID,
                 IARG_END);
 
             if (INS_HasFallThrough(ins))
@@ -503,6 +1014,7 @@ VOID Instruction_cb(INS ins, VOID *v)
                 INS_InsertCall(
                     ins, IPOINT_AFTER, (AFUNPTR)RecordMemWrite,
                     IARG_INST_PTR,
+                    IARG_THREAD_ID,
                     IARG_END);
             }
             if (INS_IsControlFlow(ins))
@@ -510,18 +1022,22 @@ VOID Instruction_cb(INS ins, VOID *v)
                 INS_InsertCall(
                     ins, IPOINT_TAKEN_BRANCH, (AFUNPTR)RecordMemWrite,
                     IARG_INST_PTR,
+                    IARG_THREAD_ID,
                     IARG_END);
             }
 
         }
     }
     if (KnobLogIns.Value()) {
-        string* disass = new string(INS_Disassemble(ins));
+        if (INS_Size(ins) > INS_SIZE_MAX)
+        {
+            cerr << "[!] Instruction size > " << INS_SIZE_MAX << " at " << hex << (void *)ceip << " " << INS_Disassemble(ins) << endl;
+            return;
+        }
         INS_InsertCall(
             ins, IPOINT_BEFORE, (AFUNPTR)printInst,
-            IARG_INST_PTR,
-            IARG_PTR, disass,
-            IARG_UINT32, INS_Size(ins),
+            IARG_PTR, GetInsData(ins),
+            IARG_THREAD_ID,
             IARG_END);
     }
 }
@@ -552,19 +1068,14 @@ void ImageLoad_cb(IMG Img, void *v)
             case SQLITE:
                 sqlite3_reset(lib_insert);
                 sqlite3_bind_text(lib_insert, 1, imageName.c_str(), -1, SQLITE_TRANSIENT);
-                value.str("");
-                value.clear();
-                value << hex << "0x" << setfill('0') << setw(16) << lowAddress;
-                strvalue = value.str();
-                sqlite3_bind_text(lib_insert, 2, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-                value.str("");
-                value.clear();
-                value << hex << "0x" << setfill('0') << setw(16) << highAddress;
-                strvalue = value.str();
-                sqlite3_bind_text(lib_insert, 3, strvalue.c_str(), -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int64(lib_insert, 2, lowAddress);
+                sqlite3_bind_int64(lib_insert, 3, highAddress);
                 if(sqlite3_step(lib_insert) != SQLITE_DONE)
                     printf("LIB error: %s\n", sqlite3_errmsg(db));
                 break;
+            case BINARY:
+                SendLibMsg(imageName, lowAddress, highAddress);
+                break;
         }
         main_begin = lowAddress;
         main_end = highAddress;
@@ -591,19 +1102,14 @@ void ImageLoad_cb(IMG Img, void *v)
             case SQLITE:
                 sqlite3_reset(lib_insert);
                 sqlite3_bind_text(lib_insert, 1, imageName.c_str(), -1, SQLITE_TRANSIENT);
-                value.str("");
-                value.clear();
-                value << hex << "0x" << setfill('0') << setw(16) << lowAddress;
-                strvalue = value.str();
-                sqlite3_bind_text(lib_insert, 2, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-                value.str("");
-                value.clear();
-                value << hex << "0x" << setfill('0') << setw(16) << highAddress;
-                strvalue = value.str();
-                sqlite3_bind_text(lib_insert, 3, strvalue.c_str(), -1, SQLITE_TRANSIENT);
+                sqlite3_bind_int64(lib_insert, 2, lowAddress);
+                sqlite3_bind_int64(lib_insert, 3, highAddress);
                 if(sqlite3_step(lib_insert) != SQLITE_DONE)
                     printf("LIB error: %s\n", sqlite3_errmsg(db));
                 break;
+            case BINARY:
+                SendLibMsg(imageName, lowAddress, highAddress);
+                break;
         }
     }
     PIN_ReleaseLock(&_lock);
@@ -613,9 +1119,10 @@ void ImageLoad_cb(IMG Img, void *v)
 /* Helper Functions for Trace_cb                                         */
 /* ===================================================================== */
 
-void LogBasicBlock(ADDRINT addr, UINT32 size)
+static VOID WriteBasicBlock(threaddata_t *td, const event_t *ev)
 {
-    PIN_GetLock(&_lock, addr);
+    ADDRINT addr = ev->ip;
+    UINT32 size = ev->size;
     if (InfoType >= B) bigcounter++;
     InfoType=B;
     currentbbl=bigcounter;
@@ -623,45 +1130,37 @@ void LogBasicBlock(ADDRINT addr, UINT32 size)
         case HUMAN:
             TraceFile << "[B]" << setw(10) << dec << bigcounter << hex << setw(16) << (void *) addr << " loc_" << hex << addr << ":";
             TraceFile << " // size=" << dec << size;
-            TraceFile << " thread=" << "0x" << hex << PIN_ThreadUid() << endl;
+            TraceFile << " thread=" << "0x" << hex << td->uid;
+            TraceFile << " stamp=" << dec << ev->stamp << endl;
             break;
         case SQLITE:
-            sqlite3_reset(bbl_insert);
-            value.str("");
-            value.clear();
-            value << "0x" << hex << setfill('0') << setw(16) << addr;
-            strvalue = value.str();
-            sqlite3_bind_text(bbl_insert, 1, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-            value.str("");
-            value.clear();
-            value << hex << "0x" << setfill('0') << setw(16) << addr + size - 1;
-            strvalue = value.str();
-            sqlite3_bind_text(bbl_insert, 2, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_bind_int(bbl_insert, 3, size);
-            sqlite3_bind_int64(bbl_insert, 4, PIN_ThreadUid());
-            if(sqlite3_step(bbl_insert) != SQLITE_DONE)
-                printf("BBL error: %s\n", sqlite3_errmsg(db));
-            bbl_id = sqlite3_last_insert_rowid(db);
+            td->bbl_id = BatchRow(&bbl_batch);
+            BatchInt64(&bbl_batch, 1, addr);
+            BatchInt64(&bbl_batch, 2, addr + size - 1);
+            BatchInt64(&bbl_batch, 3, size);
+            BatchInt64(&bbl_batch, 4, td->uid);
+            BatchInt64(&bbl_batch, 5, ev->stamp);
+            break;
+        case BINARY:
+            // Blocks are rebuilt from contiguous instructions, see AppendExec,
+            // but the instructions of two basic blocks may have been executed
+            // with other threads in between: they get their own ExecMsg
+            FlushExec(td);
+            td->exec_stamped = true;
+            td->exec_stamp = ev->stamp;
             break;
     }
-    PIN_ReleaseLock(&_lock);
 }
 
-void LogCallAndArgs(ADDRINT ip, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2)
+static VOID WriteCall(threaddata_t *td, const event_t *ev)
 {
-    string nameFunc = "";
-    string nameArg0 = "";
-    string nameArg1 = "";
-    string nameArg2 = "";
-
-    nameFunc = RTN_FindNameByAddress(ip);
-    if (KnobLogCallArgs.Value()) {
-        nameArg0 = RTN_FindNameByAddress(arg0);
-        nameArg1 = RTN_FindNameByAddress(arg1);
-        nameArg2 = RTN_FindNameByAddress(arg2);
-    }
+    ADDRINT ip = ev->ip;
+    const ADDRINT *args = (const ADDRINT *)(ev + 1);
+    const char *nameFunc = (const char *)(args + 3);
+    const char *nameArg0 = nameFunc + strlen(nameFunc) + 1;
+    const char *nameArg1 = nameArg0 + strlen(nameArg0) + 1;
+    const char *nameArg2 = nameArg1 + strlen(nameArg1) + 1;
 
-    PIN_GetLock(&_lock, ip);
     if (InfoType >= C) bigcounter++;
     InfoType=C;
     switch (LogType) {
@@ -669,9 +1168,9 @@ void LogCallAndArgs(ADDRINT ip, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2)
             TraceFile << "[C]" << setw(10) << dec << bigcounter << hex << " Calling function 0x" << ip << "(" << nameFunc << ")";
             if (KnobLogCallArgs.Value()) {
                 TraceFile << " with args: ("
-                          << (void *) arg0 << " (" << nameArg0 << " ), "
-                          << (void *) arg1 << " (" << nameArg1 << " ), "
-                          << (void *) arg2 << " (" << nameArg2 << " )";
+                          << (void *) args[0] << " (" << nameArg0 << " ), "
+                          << (void *) args[1] << " (" << nameArg1 << " ), "
+                          << (void *) args[2] << " (" << nameArg2 << " )";
             }
             TraceFile << endl;
             if (ExcludedAddress(ip))
@@ -680,24 +1179,74 @@ void LogCallAndArgs(ADDRINT ip, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2)
             }
             break;
         case SQLITE:
-            value.str("");
-            value.clear();
-            value << "0x" << hex << setfill('0') << setw(16) << ip;
-            strvalue = value.str();
-            sqlite3_bind_text(call_insert, 1, strvalue.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(call_insert, 2, nameFunc.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_reset(call_insert);
+            sqlite3_bind_int64(call_insert, 1, ip);
+            sqlite3_bind_text(call_insert, 2, nameFunc, -1, SQLITE_TRANSIENT);
             if(sqlite3_step(call_insert) != SQLITE_DONE)
                 printf("CALL error: %s\n", sqlite3_errmsg(db));
             break;
+        case BINARY:
+            // No call message in the TracerGrind protocol
+            break;
     }
-    PIN_ReleaseLock(&_lock);
 }
 
-void LogIndirectCallAndArgs(ADDRINT target, BOOL taken, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2)
+void LogBasicBlock(ADDRINT addr, UINT32 size, THREADID tid)
+{
+    event_t *ev = AllocEvent(GetThreadData(tid), 0);
+    ev->type = B;
+    ev->size = size;
+    ev->ip = addr;
+    ev->stamp = __sync_fetch_and_add(&block_stamp, 1);
+}
+
+static size_t NameLength(const string &name)
+{
+    return min(name.size(), (size_t)EVENT_NAME_MAX) + 1;
+}
+
+static char *AppendName(char *dst, const string &name)
+{
+    size_t length = NameLength(name) - 1;
+    memcpy(dst, name.c_str(), length);
+    dst[length] = '\0';
+    return dst + length + 1;
+}
+
+void LogCallAndArgs(ADDRINT ip, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2, THREADID tid)
+{
+    string nameFunc = "";
+    string nameArg0 = "";
+    string nameArg1 = "";
+    string nameArg2 = "";
+
+    nameFunc = RTN_FindNameByAddress(ip);
+    if (KnobLogCallArgs.Value()) {
+        nameArg0 = RTN_FindNameByAddress(arg0);
+        nameArg1 = RTN_FindNameByAddress(arg1);
+        nameArg2 = RTN_FindNameByAddress(arg2);
+    }
+
+    event_t *ev = AllocEvent(GetThreadData(tid), 3 * sizeof(ADDRINT) + NameLength(nameFunc) +
+                             NameLength(nameArg0) + NameLength(nameArg1) + NameLength(nameArg2));
+    ev->type = C;
+    ev->ip = ip;
+    ADDRINT *args = (ADDRINT *)(ev + 1);
+    args[0] = arg0;
+    args[1] = arg1;
+    args[2] = arg2;
+    char *names = (char *)(args + 3);
+    names = AppendName(names, nameFunc);
+    names = AppendName(names, nameArg0);
+    names = AppendName(names, nameArg1);
+    names = AppendName(names, nameArg2);
+}
+
+void LogIndirectCallAndArgs(ADDRINT target, BOOL taken, ADDRINT arg0, ADDRINT arg1, ADDRINT arg2, THREADID tid)
 {
     if (!taken)
         return;
-    LogCallAndArgs(target, arg0, arg1, arg2);
+    LogCallAndArgs(target, arg0, arg1, arg2, tid);
 }
 
 /* ================================================================================= */
@@ -741,6 +1290,7 @@ void Trace_cb(TRACE trace, void *v)
                         1,
                         IARG_FUNCARG_ENTRYPOINT_VALUE,      // Arg_2 value
                         2,
+                        IARG_THREAD_ID,
                         IARG_END
                     );
                 }
@@ -758,6 +1308,7 @@ void Trace_cb(TRACE trace, void *v)
                         1,
                         IARG_FUNCARG_ENTRYPOINT_VALUE,
                         2,
+                        IARG_THREAD_ID,
                         IARG_END
                     );
                 }
@@ -781,6 +1332,7 @@ void Trace_cb(TRACE trace, void *v)
                         1,
                         IARG_FUNCARG_ENTRYPOINT_VALUE,
                         2,
+                        IARG_THREAD_ID,
                         IARG_END
                     );
                 }
@@ -790,7 +1342,7 @@ void Trace_cb(TRACE trace, void *v)
         if(KnobLogBB.Value())
         {
             /* instrument BBL_InsHead to write "loc_XXXXX", like in IDA Pro */
-            INS_InsertCall(head, IPOINT_BEFORE, AFUNPTR(LogBasicBlock), IARG_ADDRINT, BBL_Address(bbl), IARG_UINT32, BBL_Size(bbl), IARG_END);
+            INS_InsertCall(head, IPOINT_BEFORE, AFUNPTR(LogBasicBlock), IARG_ADDRINT, BBL_Address(bbl), IARG_UINT32, BBL_Size(bbl), IARG_THREAD_ID, IARG_END);
         }
     }
 }
@@ -800,41 +1352,156 @@ void Trace_cb(TRACE trace, void *v)
 /* ================================================================================= */
 void ThreadStart_cb(THREADID threadIndex, CONTEXT *ctxt, INT32 flags, VOID *v)
 {
-    PIN_GetLock(&_lock, threadIndex + 1);
-    if (InfoType >= T) bigcounter++;
-    InfoType=T;
-    switch (LogType) {
-        case HUMAN:
-            TraceFile << "[T]" << setw(10) << dec << bigcounter << hex << " Thread 0x" << PIN_ThreadUid() << " started. Flags: 0x" << hex << flags << endl;
-            break;
-        case SQLITE:
-            sqlite3_reset(thread_insert);
-            sqlite3_bind_int64(thread_insert, 1, PIN_ThreadUid());
-            sqlite3_bind_int64(thread_insert, 2, currentbbl);
-            if(sqlite3_step(thread_insert) != SQLITE_DONE)
-                printf("THREAD error: %s\n", sqlite3_errmsg(db));
-            break;
-    }
-    PIN_ReleaseLock(&_lock);
+    threaddata_t *td = new threaddata_t;
+    td->uid = PIN_ThreadUid();
+    td->buffer = NewBuffer(td);
+    td->write_addr = 0;
+    td->write_size = 0;
+    td->bbl_id = 0;
+    td->ins_id = 0;
+    td->exec_stamped = false;
+    td->exec_stamp = 0;
+    PIN_SetThreadData(tls_key, td, threadIndex);
+    PIN_GetLock(&buffers_lock, threadIndex + 1);
+    threads.push_back(td);
+    PIN_ReleaseLock(&buffers_lock);
+
+    event_t *ev = AllocEvent(td, 0);
+    ev->type = T;
+    ev->flag = 0;
+    ev->code = flags;
 }
 
 
 void ThreadFinish_cb(THREADID threadIndex, const CONTEXT *ctxt, INT32 code, VOID *v)
 {
-    PIN_GetLock(&_lock, threadIndex + 1);
-    switch (LogType) {
-        case HUMAN:
-            TraceFile << "[T]" << setw(10) << dec << bigcounter << hex << " Thread 0x" << PIN_ThreadUid() << " finished. Code: " << dec << code << endl;
-            break;
-        case SQLITE:
-            sqlite3_reset(thread_update);
-            sqlite3_bind_int64(thread_update, 1, currentbbl);
-            sqlite3_bind_int64(thread_update, 2, PIN_ThreadUid());
-            if(sqlite3_step(thread_update) != SQLITE_DONE)
-                printf("THREAD error: %s\n", sqlite3_errmsg(db));
-            break;
+    threaddata_t *td = GetThreadData(threadIndex);
+    event_t *ev = AllocEvent(td, 0);
+    ev->type = T;
+    ev->flag = 1;
+    ev->code = code;
+    FlushBuffer(td);
+}
+
+/* ===================================================================== */
+/* Writer thread                                                         */
+/* ===================================================================== */
+
+static VOID WriteThread(threaddata_t *td, const event_t *ev)
+{
+    if (ev->flag == 0)
+    {
+        if (InfoType >= T) bigcounter++;
+        InfoType=T;
+        switch (LogType) {
+            case HUMAN:
+                TraceFile << "[T]" << setw(10) << dec << bigcounter << hex << " Thread 0x" << td->uid << " started. Flags: 0x" << hex << ev->code << endl;
+                break;
+            case SQLITE:
+                sqlite3_reset(thread_insert);
+                sqlite3_bind_int64(thread_insert, 1, td->uid);
+                sqlite3_bind_int64(thread_insert, 2, currentbbl);
+                if(sqlite3_step(thread_insert) != SQLITE_DONE)
+                    printf("THREAD error: %s\n", sqlite3_errmsg(db));
+                break;
+            case BINARY:
+                SendThreadMsg(td, THREAD_CREATE);
+                break;
+        }
+    }
+    else
+    {
+        switch (LogType) {
+            case HUMAN:
+                TraceFile << "[T]" << setw(10) << dec << bigcounter << hex << " Thread 0x" << td->uid << " finished. Code: " << dec << ev->code << endl;
+                break;
+            case SQLITE:
+                // Their instruction was never logged, and any ins_id would
+                // break the order of the mem rows
+                td->pending_reads.clear();
+                sqlite3_reset(thread_update);
+                sqlite3_bind_int64(thread_update, 1, currentbbl);
+                sqlite3_bind_int64(thread_update, 2, td->uid);
+                if(sqlite3_step(thread_update) != SQLITE_DONE)
+                    printf("THREAD error: %s\n", sqlite3_errmsg(db));
+                break;
+            case BINARY:
+                td->exec_mem.append(td->pending_reads);
+                td->pending_reads.clear();
+                FlushExec(td);
+                SendThreadMsg(td, THREAD_EXIT);
+                break;
+        }
+    }
+}
+
+static VOID WriteEvents(evbuffer_t *buffer)
+{
+    threaddata_t *td = buffer->owner;
+    size_t offset = 0;
+    while (offset < buffer->used)
+    {
+        const event_t *ev = (const event_t *) &(buffer->data[offset]);
+        switch (ev->type) {
+            case T:
+                WriteThread(td, ev);
+                break;
+            case C:
+                WriteCall(td, ev);
+                break;
+            case B:
+                WriteBasicBlock(td, ev);
+                break;
+            case I:
+                WriteInst(td, ev);
+                break;
+            case R:
+            case W:
+                WriteMem(td, ev);
+                break;
+        }
+        offset += ev->length;
     }
+}
+
+// Write all the buffers handed over so far, in the order they were received
+static VOID DrainBuffers()
+{
+    std::deque<evbuffer_t *> pending;
+    PIN_GetLock(&buffers_lock, 0);
+    pending.swap(full_buffers);
+    PIN_ReleaseLock(&buffers_lock);
+    if (pending.empty())
+        return;
+
+    PIN_GetLock(&_lock, 0);
+    for (size_t i = 0; i < pending.size(); i++)
+        WriteEvents(pending[i]);
     PIN_ReleaseLock(&_lock);
+
+    PIN_GetLock(&buffers_lock, 0);
+    free_buffers.insert(free_buffers.end(), pending.begin(), pending.end());
+    PIN_ReleaseLock(&buffers_lock);
+    PIN_SemaphoreSet(&buffers_written);
+}
+
+static VOID WriterThread(VOID *arg)
+{
+    while (!writer_stop)
+    {
+        PIN_SemaphoreWait(&buffers_ready);
+        PIN_SemaphoreClear(&buffers_ready);
+        DrainBuffers();
+    }
+}
+
+static VOID PrepareForFini(VOID *v)
+{
+    writer_stop = true;
+    PIN_SemaphoreSet(&buffers_ready);
+    PIN_WaitForThreadTermination(writer_uid, PIN_INFINITE_TIMEOUT, NULL);
+    // Nothing drains the queue anymore, release the threads waiting for it
+    PIN_SemaphoreSet(&buffers_written);
 }
 
 /* ===================================================================== */
@@ -843,17 +1510,45 @@ void ThreadFinish_cb(THREADID threadIndex, const CONTEXT *ctxt, INT32 code, VOID
 
 VOID Fini(INT32 code, VOID *v)
 {
+    // Threads still alive at exit keep a partially filled buffer
+    PIN_GetLock(&buffers_lock, 0);
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threaddata_t *td = threads[i];
+        if ((td->buffer != NULL) && (td->buffer->used > 0))
+        {
+            full_buffers.push_back(td->buffer);
+            td->buffer = NULL;
+        }
+    }
+    PIN_ReleaseLock(&buffers_lock);
+    DrainBuffers();
+
     switch (LogType) {
         case HUMAN:
             TraceFile.close();
             break;
+        case BINARY:
+            for (size_t i = 0; i < threads.size(); i++)
+            {
+                threads[i]->exec_mem.append(threads[i]->pending_reads);
+                threads[i]->pending_reads.clear();
+                FlushExec(threads[i]);
+            }
+            if (KnobCompress.Value())
+                WriteCompressed(true);
+            TraceFile.close();
+            break;
         case SQLITE:
+            BatchFinalize(&bbl_batch);
+            BatchFinalize(&static_ins_batch);
+            BatchFinalize(&ins_batch);
+            BatchFinalize(&mem_batch);
+            if(sqlite3_exec(db, INDEX_QUERY, NULL, NULL, NULL) != SQLITE_OK)
+                cerr << "Could not create indexes: " << sqlite3_errmsg(db) << endl;
             sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
             sqlite3_finalize(info_insert);
             sqlite3_finalize(lib_insert);
-            sqlite3_finalize(bbl_insert);
-            sqlite3_finalize(ins_insert);
-            sqlite3_finalize(mem_insert);
             sqlite3_finalize(call_insert);
             sqlite3_finalize(thread_insert);
             sqlite3_finalize(thread_update);
@@ -878,6 +1573,12 @@ int  main(int argc, char *argv[])
         return Usage();
     }
 
+    PIN_InitLock(&_lock);
+    PIN_InitLock(&buffers_lock);
+    PIN_SemaphoreInit(&buffers_ready);
+    PIN_SemaphoreInit(&buffers_written);
+    tls_key = PIN_CreateThreadDataKey(NULL);
+
     char *endptr;
     const char *tmpfilter = KnobLogFilter.Value().c_str();
     logfilter=strtoull(tmpfilter, &endptr, 16);
@@ -953,6 +1654,12 @@ int  main(int argc, char *argv[])
         if (TraceName.compare("trace-full-info.txt") == 0)
             TraceName = "trace-full-info.sqlite";
     }
+    else if (KnobLogType.Value().compare("binary") == 0)
+    {
+        LogType = BINARY;
+        if (TraceName.compare("trace-full-info.txt") == 0)
+            TraceName = "trace-full-info.trace";
+    }
     switch (LogType) {
         case HUMAN:
             TraceFile.open(TraceName.c_str());
@@ -983,15 +1690,30 @@ int  main(int argc, char *argv[])
             }
             sqlite3_prepare_v2(db, "INSERT INTO info (key, value) VALUES (?, ?);", -1, &info_insert, NULL);
             sqlite3_prepare_v2(db, "INSERT INTO lib (name, base, end) VALUES (?, ?, ?);", -1, &lib_insert, NULL);
-            sqlite3_prepare_v2(db, "INSERT INTO bbl (addr, addr_end, size, thread_id) VALUES (?, ?, ?, ?);", -1, &bbl_insert, NULL);
+            BatchInit(&bbl_batch, "bbl", "rowid, addr, addr_end, size, thread_id, stamp", 6);
             sqlite3_prepare_v2(db, "INSERT INTO call (addr, name) VALUES (?, ?);", -1, &call_insert, NULL);
-            sqlite3_prepare_v2(db, "INSERT INTO ins (bbl_id, ip, dis, op) VALUES (?, ?, ?, ?);", -1, &ins_insert, NULL);
-            sqlite3_prepare_v2(db, "INSERT INTO mem (ins_id, ip, type, addr, addr_end, size, data, value) VALUES (?, ?, ?, ?, ?, ?, ?, ?);", -1, &mem_insert, NULL);
+            BatchInit(&static_ins_batch, "static_ins", "id, ip, dis, op", 4);
+            BatchInit(&ins_batch, "ins", "rowid, bbl_id, static_ins_id", 3);
+            BatchInit(&mem_batch, "mem", "rowid, ins_id, ip, type, addr, addr_end, size, data, value", 9);
             sqlite3_prepare_v2(db, "INSERT INTO thread (thread_id, start_bbl_id) VALUES (?, ?);", -1, &thread_insert, NULL);
             sqlite3_prepare_v2(db, "UPDATE thread SET exit_bbl_id=? WHERE thread_id=?;", -1, &thread_update, NULL);
 
             sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
 
+            break;
+        case BINARY:
+            TraceFile.open(TraceName.c_str(), ios::out | ios::binary);
+            if(TraceFile.fail())
+            {
+                cerr << "[!] Something went wrong opening the log file..." << endl;
+                return -1;
+            } else {
+                if (KnobCompress.Value())
+                    TraceFile.write((const char *) TRACE_COMPRESS_MAGIC, sizeof(TRACE_COMPRESS_MAGIC));
+                if (! KnobQuiet.Value()) {
+                    cerr << "[*] Trace file " << TraceName << " opened for writing..." << endl << endl;
+                }
+            }
             break;
     }
 
@@ -1005,6 +1727,37 @@ int  main(int argc, char *argv[])
                 TraceFile << "[*]" << setw(5) << nArg << ": " << argv[nArg] << endl;
             TraceFile.unsetf(ios::showbase);
             break;
+        case BINARY:
+        {
+            value.str("");
+            value.clear();
+            value << GIT_DESC << " / PIN " << PIN_PRODUCT_VERSION_MAJOR << "." << PIN_PRODUCT_VERSION_MINOR << " build " << PIN_BUILD_NUMBER;
+            SendInfoMsg("TRACERPIN_VERSION", value.str());
+#if defined(TARGET_IA32E)
+            SendInfoMsg(STR_ARCH, "AMD64");
+#else
+            SendInfoMsg(STR_ARCH, "X86");
+#endif
+            value.str("");
+            value.clear();
+            int nArg=0;
+            for (; (nArg < argc) && std::string(argv[nArg]) != "--"; nArg++) {
+                if (nArg>0) value << " ";
+                value << argv[nArg];
+            }
+            SendInfoMsg("PINPROGRAM", value.str());
+            if (++nArg < argc)
+                SendInfoMsg(STR_PROGRAM, argv[nArg++]);
+            value.str("");
+            value.clear();
+            int nArg_start=nArg;
+            for (; (nArg < argc); nArg++) {
+                if (nArg>nArg_start) value << " ";
+                value << argv[nArg];
+            }
+            SendInfoMsg(STR_ARGS, value.str());
+            break;
+        }
         case SQLITE:
             sqlite3_reset(info_insert);
             sqlite3_bind_text(info_insert, 1, "TRACERPIN_VERSION", -1, SQLITE_TRANSIENT);
@@ -1016,6 +1769,12 @@ int  main(int argc, char *argv[])
             if(sqlite3_step(info_insert) != SQLITE_DONE)
                 printf("INFO error: %s\n", sqlite3_errmsg(db));
 
+            sqlite3_reset(info_insert);
+            sqlite3_bind_text(info_insert, 1, "SCHEMA_VERSION", -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(info_insert, 2, SCHEMA_VERSION, -1, SQLITE_TRANSIENT);
+            if(sqlite3_step(info_insert) != SQLITE_DONE)
+                printf("INFO error: %s\n", sqlite3_errmsg(db));
+
             sqlite3_reset(info_insert);
             sqlite3_bind_text(info_insert, 1, "PINPROGRAM", -1, SQLITE_TRANSIENT);
             value.str("");
@@ -1059,8 +1818,15 @@ int  main(int argc, char *argv[])
     PIN_AddThreadFiniFunction(ThreadFinish_cb, 0);
     TRACE_AddInstrumentFunction(Trace_cb, 0);
     INS_AddInstrumentFunction(Instruction_cb, 0);
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
     PIN_AddFiniFunction(Fini, 0);
 
+    if (PIN_SpawnInternalThread(WriterThread, NULL, 0, &writer_uid) == INVALID_THREADID)
+    {
+        cerr << "[!] Could not spawn the writer thread" << endl;
+        return -1;
+    }
+
     // Never returns
 
     PIN_StartProgram();